@@ -0,0 +1,102 @@
+/* Benchmarks of the text kernels against plain byte loops.
+ * Build and run with make bench, or make bench CFLAGS=-mavx2 */
+
+#define main chat_server_main
+#include "chat_server.c"
+#undef main
+
+#define BENCH_LINE 1024 /* Bytes per benchmarked line, like a full read */
+#define BENCH_ROUNDS 200000
+
+/* Byte at a time newline scan, as the server did before the kernels */
+static char *bench_scan_scalar (char *s, const char *end)
+{
+	while (s < end && *s != '\0' && *s != '\r' && *s != '\n')
+		s++;
+
+	return s;
+}
+
+/* Byte at a time sanitizing, the fallback of text_sanitize */
+static size_t bench_sanitize_scalar (char *s, size_t len)
+{
+	unsigned char *in = (unsigned char *)s, *out = in;
+	const unsigned char *end = in + len;
+
+	while (in < end)
+		sanitize_step (&in, end, &out);
+
+	return out - (unsigned char *)s;
+}
+
+static double bench_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Print the throughput of rounds over len bytes */
+static void bench_report (const char *name, double start, size_t len)
+{
+	double secs = bench_now () - start;
+
+	printf ("%-28s %8.1f ns/line %8.2f GB/s\n", name, secs * 1e9 / BENCH_ROUNDS, len * (double)BENCH_ROUNDS / secs / 1e9);
+}
+
+int main (void)
+{
+	static char line[BENCH_LINE + 1], work[BENCH_LINE + 1];
+	volatile size_t sink = 0;
+	double start;
+	int i;
+
+	/* Printable text with the line end at the very end, the worst case of a scan */
+	for (i = 0; i < BENCH_LINE - 1; i++)
+		line[i] = 'a' + i % 26;
+
+	line[BENCH_LINE - 1] = '\n';
+
+	start = bench_now ();
+	for (i = 0; i < BENCH_ROUNDS; i++)
+		sink += bench_scan_scalar (line + (i & 1), line + BENCH_LINE) - line;
+	bench_report ("scan_newline scalar", start, BENCH_LINE);
+
+	start = bench_now ();
+	for (i = 0; i < BENCH_ROUNDS; i++)
+		sink += scan_newline (line + (i & 1), line + BENCH_LINE) - line;
+	bench_report ("scan_newline", start, BENCH_LINE);
+
+	/* Plain text, the common case the vector path keeps without per byte work */
+	start = bench_now ();
+	for (i = 0; i < BENCH_ROUNDS; i++)
+	{
+		memcpy (work, line, BENCH_LINE);
+		sink += bench_sanitize_scalar (work, BENCH_LINE - 1);
+	}
+	bench_report ("text_sanitize scalar", start, BENCH_LINE);
+
+	start = bench_now ();
+	for (i = 0; i < BENCH_ROUNDS; i++)
+	{
+		memcpy (work, line, BENCH_LINE);
+		sink += text_sanitize (work, BENCH_LINE - 1);
+	}
+	bench_report ("text_sanitize", start, BENCH_LINE);
+
+	/* Check the kernels agree with the byte loops */
+	for (i = 0; i < BENCH_LINE; i++)
+	{
+		memcpy (work, line, BENCH_LINE);
+		work[i] = i % 3 ? '\x1B' : '\r';
+
+		if (scan_newline (work, work + BENCH_LINE) != bench_scan_scalar (work, work + BENCH_LINE))
+		{
+			printf ("scan_newline differs at %d\n", i);
+			return 1;
+		}
+	}
+
+	return sink == 0;
+}
@@ -19,8 +19,30 @@
 #include <ctype.h>
 #include <string.h>
 #include <time.h>
+#include <math.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#include <sys/random.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
 #include "tinyexpr.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 #define KNRM  "\x1B[0m"
 #define KRED  "\x1B[31m"
 #define KGRN  "\x1B[32m"
@@ -30,16 +52,392 @@
 #define KCYN  "\x1B[36m"
 #define KWHT  "\x1B[37m"
 
-#define MAX_COMPARES 16 /* Maximum number of compare strings */
-#define MAX_COMPARE_LENGTH 10 /* Set for length of maximum compare string */
+#define MAX_COMPARES 26 /* Maximum number of compare strings */
+#define MAX_COMPARE_LENGTH 12 /* Set for length of maximum compare string */
 #define MAX_NAME_LENGTH 32 /* Max name length */
 #define MAX_CLIENTS	100 /* Max number of clients */
 #define MAX_BUFFER_LENGTH 1026 /* Max buffer size */
 #define MAX_SHORT_MESSAGE_LENGTH 256 /* Max length for a short essage */
+#define MAX_ROOMS (MAX_CLIENTS + 1) /* Max number of rooms, enough for every client in its own room */
+#define ROOM_HISTORY_LENGTH 32 /* Max number of messages kept per room */
+#define HISTORY_POOL_SIZE 1024 /* Message slots shared by all rooms, caps total history memory */
+#define MAX_HISTORY_MESSAGE_LENGTH (MAX_BUFFER_LENGTH + 128) /* Max length of a stored message */
+#define LOG_BUFFER_SIZE (256 * 1024) /* Room log bytes queued before producers wait for the writer */
+#define LOG_SEGMENT_SIZE (4 * 1024 * 1024) /* Room log segment size before rotation */
+#define LOG_SEGMENTS_KEEP 4 /* Number of room log segments kept and replayed */
+#define LOG_SYNC_INTERVAL 1 /* Seconds between room log syncs */
+#define SNAPSHOT_INTERVAL 5 /* Seconds between state snapshots */
+#define SNAPSHOT_RESTORE_WINDOW 300 /* Seconds after startup during which sessions are restored */
+#define SNAPSHOT_MAGIC "CSS2" /* Snapshot file signature */
+#define HANDOFF_BATCH 64 /* Client sockets passed per handoff message */
+#define HANDOFF_FREEZE_TIMEOUT 2000 /* Milliseconds to wait for every thread to park */
+#define HANDOFF_MAGIC "CSH2" /* Handoff protocol signature */
+#define MAX_PEERS 16 /* Max number of federation links, must fit in a bitmask */
+#define MAX_FED_NODES 64 /* Max number of federated nodes known */
+#define FED_MAX_FRAME (16 * 1024) /* Max federation frame payload */
+#define FED_LINK_BUFFER (256 * 1024) /* Federation bytes queued per link before frames are dropped */
+#define FED_FLUSH_INTERVAL 2 /* Milliseconds between federation batch writes */
+#define FED_ADVERTISE_INTERVAL 5 /* Seconds between unchanged advertisements */
+#define FED_EXPIRE 15 /* Seconds before a silent node is forgotten */
+#define FED_RECONNECT_INTERVAL 2 /* Seconds between link attempts */
+#define FED_TTL 8 /* Max hops of a federation frame */
+#define FED_SEEN_SIZE 4096 /* Recently seen frame ids, power of two */
+#define SHM_MAX_PROCS 16 /* Max number of processes sharing a registry */
+#define SHM_RING_SLOTS 256 /* Messages queued per process, power of two */
+#define SHM_HEARTBEAT_TIMEOUT 5 /* Seconds before a silent process is ignored */
+#define SHM_READ_SPINS 4096 /* Tries of a shared row read before skipping it */
+#define URING_ENTRIES 128 /* io_uring submission queue size */
+#define URING_BUFFER_SIZE (MAX_HISTORY_MESSAGE_LENGTH + 128) /* Registered fanout buffer */
+#define COALESCE_BUFFER_SIZE (64 * 1024) /* Output queued per client between coalescing flushes */
+#define TRACE_THREADS 256 /* Threads recording trace events at once */
+#define TRACE_RING_SIZE 4096 /* Trace events kept per thread, power of two */
+#define EVENT_THREADS 256 /* Threads logging events at once */
+#define EVENT_RING_SIZE 256 /* Events buffered per thread, power of two */
+#define EVENT_FLUSH_INTERVAL 100 /* Milliseconds between event log writes */
+#define EVENT_BATCH_SIZE (64 * 1024) /* Formatted events written at once */
+#define EVENT_MAX_LENGTH 1024 /* Longest formatted event */
+#define TOP_COUNTERS 64 /* Counters per heavy hitter summary */
+#define TOP_SHOWN 10 /* Heavy hitters listed by \top */
+#define ROSTER_LINE_LENGTH (MAX_SHORT_MESSAGE_LENGTH + 2 * MAX_NAME_LENGTH + 64) /* Longest roster line */
+#define MAX_PREFIX_LENGTH (2 * MAX_NAME_LENGTH + 32) /* Rendered color, room and name of a sender */
+#define WHO_PAGE_SIZE 20 /* Clients listed per \who page */
+#define TIMER_TICK 100 /* Timer wheel resolution in milliseconds */
+#define WHEEL_SLOTS 256 /* Slots per timer wheel level, power of two */
+#define WHEEL_LEVELS 2 /* Timer wheel levels, the last one reaches WHEEL_SLOTS ^ WHEEL_LEVELS ticks */
+#define WATCH_FDS 4096 /* Descriptors whose writes are watched for stalls */
+#define ADMIT_TABLE_SIZE 256 /* Source addresses tracked by admission control, power of two */
+#define ADMIT_PROBES 16 /* Slots searched for an address before a connection is refused */
+#define SPAM_SENDER_WINDOW 8 /* Fingerprints kept of the latest messages of each client */
+#define SPAM_GLOBAL_WINDOW 64 /* Fingerprints kept of the latest messages of every client */
+#define SPAM_DISTANCE 12 /* Differing fingerprint bits of near duplicates */
+#define SPAM_MIN_LENGTH 12 /* Letters and digits a message needs to be fingerprinted */
+#define FILTER_PATTERNS 256 /* Patterns in the word filter file */
+#define FILTER_PATTERN_LENGTH 64 /* Longest filtered pattern */
+#define MAX_MATH_VARS 16 /* Max number of \let variables per client, must fit in a bitmask */
+#define MAX_MATH_FUNCS 8 /* Max number of \def functions per client, must fit in a bitmask */
+#define MAX_MATH_DEPTH 32 /* Max nesting of user function calls */
 
-static unsigned int cli_count = 0;
+static atomic_uint cli_count = 0;
 static char colors[4][10] = {KGRN, KBLU, KMAG, KCYN};
 
+/* Stored room message */
+typedef struct
+{
+	char name[MAX_NAME_LENGTH + 1];				/* Sender, so mute lists apply on replay */
+	int len;									/* Message length */
+	char text[MAX_HISTORY_MESSAGE_LENGTH];		/* Rendered message */
+} history_slot_t;
+
+/* Room structure */
+typedef struct
+{
+	char name[MAX_NAME_LENGTH + 1];				/* Room name, empty if unused */
+	int members;								/* Clients in the room */
+	int history[ROOM_HISTORY_LENGTH];			/* Ring of history pool slots */
+	int head;									/* Oldest message in the ring */
+	int count;									/* Messages in the ring */
+	atomic_ulong msgs;							/* Messages sent to the room */
+	atomic_ulong bytes;							/* Bytes of those messages */
+	atomic_ulong window;						/* Second being counted */
+	atomic_ulong window_msgs;					/* Messages in that second */
+	atomic_ulong window_bytes;
+	atomic_ulong last_msgs;						/* Messages in the second before */
+	atomic_ulong last_bytes;
+	atomic_int peak_fanout;						/* Most members a message went to */
+	atomic_ulong roster_gen;					/* Bumped when a member comes, goes or changes */
+} room_t;
+
+static room_t rooms[MAX_ROOMS];
+static history_slot_t history_pool[HISTORY_POOL_SIZE];
+static int history_free[HISTORY_POOL_SIZE];
+static int history_free_count;
+static pthread_mutex_t rooms_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Room log record header, followed by room, name and text */
+typedef struct
+{
+	uint32_t len;								/* Record length including the header */
+	uint8_t room_len;							/* Room name length */
+	uint8_t name_len;							/* Sender name length */
+	uint16_t text_len;							/* Message length */
+} log_record_t;
+
+static char log_dir[PATH_MAX];
+static int log_fd = -1;
+static unsigned int log_seq;
+static size_t log_segment_size;
+static char *log_buf;
+static char *log_spare;
+static size_t log_len;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t log_write_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t log_space = PTHREAD_COND_INITIALIZER;
+
+/* Variable defined with \let */
+typedef struct
+{
+	char name[MAX_NAME_LENGTH + 1];				/* Variable name */
+	char text[MAX_SHORT_MESSAGE_LENGTH + 1];	/* Source expression */
+	double value;								/* Last evaluated value, bound into expressions */
+	te_expr *expr;								/* Compiled expression */
+	unsigned int vdeps;							/* Variables read directly by the expression */
+	unsigned int fdeps;							/* Functions called directly by the expression */
+} math_var_t;
+
+/* Function defined with \def */
+typedef struct
+{
+	char name[MAX_NAME_LENGTH + 1];				/* Function name */
+	char param[MAX_NAME_LENGTH + 1];			/* Parameter name */
+	char text[MAX_SHORT_MESSAGE_LENGTH + 1];	/* Source expression */
+	double arg;									/* Parameter value, bound into the body */
+	te_expr *body;								/* Compiled body */
+	unsigned int vdeps;							/* Variables read directly by the body */
+	unsigned int fdeps;							/* Functions called directly by the body */
+	int depth;									/* Current call depth */
+} math_func_t;
+
+/* Per client math environment */
+typedef struct
+{
+	math_var_t vars[MAX_MATH_VARS];
+	int var_count;
+	math_func_t funcs[MAX_MATH_FUNCS];
+	int func_count;
+} math_env_t;
+
+/* Rate limited classes of client input */
+#define RATE_MESSAGE 0							/* Room messages, \me and \roll */
+#define RATE_DIRECT 1							/* \pm and \bell */
+#define RATE_COMMAND 2							/* Expensive commands, \who, \math, \history... */
+#define RATE_CLASSES 3
+
+/* Token bucket settings of a class */
+typedef struct
+{
+	const char *name;							/* Name used by -r and \stats */
+	unsigned int rate;							/* Tokens added per second, 0 disables the limit */
+	unsigned int burst;							/* Bucket size */
+} rate_limit_t;
+
+/* Token bucket, tokens are counted in thousandths */
+typedef struct
+{
+	unsigned long tokens;						/* Available tokens */
+	unsigned long stamp;						/* Last refill in milliseconds */
+} bucket_t;
+
+static rate_limit_t rate_limits[RATE_CLASSES] = {{"msg", 0, 0}, {"pm", 0, 0}, {"cmd", 0, 0}};
+static atomic_ulong rate_throttled[RATE_CLASSES];
+
+/* Fingerprint of a recent message */
+typedef struct
+{
+	uint64_t print;								/* SimHash of the message */
+	unsigned long stamp;						/* Milliseconds */
+	unsigned long conn;							/* Connection of the sender, slots are reused */
+} spam_print_t;
+
+static unsigned int spam_sender_repeats = 0;	/* Near duplicates of a client's own recent messages before dropping, 0 is off */
+static unsigned int spam_global_repeats = 0;	/* Near duplicates from other clients before dropping, 0 is off */
+static unsigned long spam_window = 0;			/* Milliseconds a fingerprint is compared */
+static spam_print_t spam_recent[SPAM_GLOBAL_WINDOW];
+static unsigned int spam_next;
+static pthread_mutex_t spam_mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_ulong spam_conns;					/* Connections numbered so far */
+static atomic_ulong spam_dropped;
+
+/* Admission state of a source address */
+typedef struct
+{
+	uint32_t addr;								/* IPv4 address, network order */
+	unsigned int conns;							/* Open connections */
+	bucket_t accepts;							/* Accept rate */
+} admit_entry_t;
+
+static admit_entry_t admit_table[ADMIT_TABLE_SIZE];
+static unsigned int admit_max_conns = 10;
+static rate_limit_t admit_limit = {"accept", 2, 5};
+static unsigned long admit_rejected;
+static pthread_mutex_t admit_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Latency stages of a message */
+#define LAT_READ 0								/* Read until the line is dispatched */
+#define LAT_DISPATCH 1							/* Dispatch until the message is handed to the room */
+#define LAT_WRITE 2								/* Hand over until direct writes to the room complete */
+#define LAT_FLUSH 3								/* Coalesced output waiting and being written */
+#define LAT_STAGES 4
+
+/* Latency counters of a stage, in nanoseconds */
+typedef struct
+{
+	atomic_ulong count;
+	atomic_ulong total;
+	atomic_ulong max;
+} lat_stat_t;
+
+static const char *lat_names[LAT_STAGES] = {"read", "dispatch", "write", "flush"};
+static lat_stat_t lat_total[LAT_STAGES];
+static char *admin_password;
+
+/* Finished span, names are static strings */
+typedef struct
+{
+	const char *name;
+	unsigned long start;						/* Nanoseconds */
+	unsigned long dur;
+	int tid;									/* Recording thread */
+} trace_event_t;
+
+/* Events of one thread, written only by that thread */
+typedef struct
+{
+	_Atomic (trace_event_t *) events;			/* TRACE_RING_SIZE entries, allocated on first use */
+	atomic_ulong head;							/* Events written so far */
+	atomic_int owner;							/* Thread using the ring, 0 if free */
+} trace_ring_t;
+
+static int trace_on;
+static char *trace_path;
+static trace_ring_t trace_rings[TRACE_THREADS];
+static pthread_key_t trace_key;
+static __thread trace_ring_t *trace_ring;
+static __thread int trace_tid;
+
+/* Event log record types */
+#define EVENT_CONNECT 0
+#define EVENT_DISCONNECT 1
+#define EVENT_RENAME 2
+#define EVENT_ROOM 3
+#define EVENT_REJECT 4
+
+/* Event log record, formatted by the writer thread */
+typedef struct
+{
+	int type;									/* EVENT_* */
+	struct timespec ts;							/* Wall clock time */
+	uint32_t addr;								/* Remote IPv4 address, network order */
+	int uid;									/* Client, -1 if none */
+	char name[MAX_NAME_LENGTH + 1];				/* Client name, old name for a rename */
+	char room[MAX_NAME_LENGTH + 1];				/* Client room, old room for a move */
+	char detail[MAX_NAME_LENGTH + 1];			/* New name, new room or reject reason */
+} event_t;
+
+/* Events of one thread, written by that thread and drained by the writer */
+typedef struct
+{
+	_Atomic (event_t *) events;					/* EVENT_RING_SIZE entries, allocated on first use */
+	atomic_ulong head;							/* Events written */
+	atomic_ulong tail;							/* Events drained */
+	atomic_int owner;							/* Thread using the ring, 0 if free */
+} event_ring_t;
+
+static const char *event_names[] = {"connect", "disconnect", "rename", "room", "reject"};
+static int event_fd = -1;
+static event_ring_t event_rings[EVENT_THREADS];
+static atomic_ulong event_dropped;
+static pthread_key_t event_key;
+static __thread event_ring_t *event_ring;
+static __thread int event_full;
+
+/* Space-Saving counter, count overestimates the true weight by at most error */
+typedef struct
+{
+	char key[MAX_NAME_LENGTH + 1];
+	unsigned long count;
+	unsigned long error;
+} top_entry_t;
+
+/* Heavy hitter summary in constant memory */
+typedef struct
+{
+	const char *title;
+	top_entry_t entries[TOP_COUNTERS];
+	int used;
+} top_summary_t;
+
+#define TOP_SENDER_MSGS 0
+#define TOP_SENDER_BYTES 1
+#define TOP_ROOM_MSGS 2
+#define TOP_ROOM_BYTES 3
+#define TOP_SUMMARIES 4
+
+static top_summary_t top_summaries[TOP_SUMMARIES] = {{"SENDERS BY MESSAGES"}, {"SENDERS BY BYTES"}, {"ROOMS BY MESSAGES"}, {"ROOMS BY BYTES"}};
+static pthread_mutex_t top_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Line of a roster */
+typedef struct
+{
+	char key[MAX_NAME_LENGTH + 1];				/* Lower case name, the sort key */
+	size_t off;									/* Start of the line in the text */
+	int uid;
+} roster_entry_t;
+
+/* Rendered list of clients sorted by name, shared by every client sending it */
+typedef struct
+{
+	atomic_int refs;							/* Cache reference plus one per sender */
+	unsigned long gen;							/* roster_gen of the room, or the global one, it was built from */
+	char room[MAX_NAME_LENGTH + 1];				/* Room listed, empty for every client */
+	roster_entry_t entries[MAX_CLIENTS];
+	int count;
+	size_t len;
+	char text[];
+} roster_t;
+
+static atomic_ulong roster_gen = 1;				/* Bumped when any client comes, goes or changes */
+static roster_t *roster_all;					/* \who list */
+static roster_t *roster_rooms[MAX_ROOMS];		/* \room lists, by room table index */
+static pthread_mutex_t roster_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* State of the word filter automaton, transitions already follow the failure links */
+typedef struct
+{
+	unsigned short next[256];					/* By input byte, both cases of a letter lead to the same node */
+	short out;									/* Longest pattern ending here, -1 if none */
+	unsigned short dict;						/* Nearest node down the failure links with a pattern, 0 if none */
+} filter_node_t;
+
+/* Aho-Corasick automaton of the word filter, replaced as a whole on reload */
+typedef struct
+{
+	atomic_int refs;							/* Current filter reference plus one per user */
+	int count;
+	char patterns[FILTER_PATTERNS][FILTER_PATTERN_LENGTH + 1];
+	int lens[FILTER_PATTERNS];
+	atomic_ulong hits[FILTER_PATTERNS];
+	atomic_ulong messages;						/* Messages with at least one hit */
+	int nodes;
+	filter_node_t node[];
+} filter_t;
+
+static char *filter_path;
+static _Atomic (filter_t *) filter_cur;
+static atomic_uint filter_epoch;				/* Picks the counter of filter_getting readers use */
+static atomic_int filter_getting[2];			/* Readers that loaded filter_cur and may not hold a reference yet */
+static pthread_mutex_t filter_mutex = PTHREAD_MUTEX_INITIALIZER;	/* Serializes reloads */
+
+/* Timer wheel entry, linked into the slot of its expiry tick */
+typedef struct wheel_timer
+{
+	struct wheel_timer *next;
+	struct wheel_timer *prev;
+	unsigned long expires;						/* Tick */
+	void (*fn) (struct wheel_timer *t, unsigned long now);
+	void *arg;
+} wheel_timer_t;
+
+static wheel_timer_t wheel[WHEEL_LEVELS][WHEEL_SLOTS];	/* Slot list heads */
+static unsigned long wheel_now;					/* Last tick run */
+static atomic_ulong timer_ticks;				/* Current tick, read by client threads */
+static atomic_ulong write_since[WATCH_FDS];		/* Tick a blocking write started, 0 if none */
+static atomic_ulong write_done[WATCH_FDS];		/* Tick the last write ended */
+static unsigned long idle_timeout;				/* Ticks without input before a client is dropped */
+static unsigned long keepalive_interval;		/* Ticks without output before a keepalive */
+static unsigned long stall_timeout;				/* Ticks a write may block */
+static pthread_mutex_t wheel_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /* Client structure */
 typedef struct
 {
@@ -48,215 +446,5276 @@ typedef struct
 	int uid;								/* Client unique identifier */
 	char name[MAX_NAME_LENGTH + 1];			/* Client name */
 	char room[MAX_NAME_LENGTH + 1]; 			/* Client room */
+	room_t *rm;								/* Room entry, NULL if the room table is full */
 	int echo;								/* Echo status */
 	char status[MAX_SHORT_MESSAGE_LENGTH + 1];	/* User Status */
 	char mute[MAX_SHORT_MESSAGE_LENGTH + 1];	/* Mute List */
+	math_env_t *math;						/* Math variables and functions, allocated on first use */
+	pthread_t tid;							/* Handler thread */
+	int resumed;							/* Handed over by a previous process */
+	char *out;								/* Coalesced output, NULL if coalescing is off */
+	size_t out_len;							/* Bytes waiting in out */
+	pthread_mutex_t out_mutex;				/* Protects out, and connfd once it is closed */
+	atomic_int refs;						/* Held by the flusher while it writes outside clients_mutex */
+	bucket_t bucket[RATE_CLASSES];			/* Input rate limits */
+	int throttled;							/* Told about the limit since the last accepted input */
+	wheel_timer_t timer;					/* Idle, keepalive and write stall checks */
+	atomic_ulong last_input;				/* Tick of the last read */
+	lat_stat_t lat[LAT_STAGES];				/* Latency of messages sent or received */
+	unsigned long out_since;				/* When out became non empty */
+	int admin;								/* May use admin commands */
+	uint64_t token;							/* Session token for \resume, 0 if none */
+	spam_print_t spam[SPAM_SENDER_WINDOW];	/* Fingerprints of the latest messages sent */
+	unsigned int spam_count;				/* Messages fingerprinted, the ring holds the latest */
+	unsigned long spam_conn;				/* Number of this connection in the spam windows */
+	int spammed;							/* Told about a dropped duplicate since the last accepted message */
+	char prefix[MAX_PREFIX_LENGTH];			/* Rendered "<room>[name] " put before each message */
+	size_t prefix_len;
 } client_t;
 
+/* Stamps of the message being handled by a client thread */
+static __thread client_t *lat_cli;
+static __thread unsigned long lat_read;
+static __thread unsigned long lat_dispatch;
+
 static client_t *clients[MAX_CLIENTS];
+static useconds_t coalesce_window;
+static pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Persistent part of the client state */
+typedef struct
+{
+	uint64_t token;								/* Secret the client resumes the session with, 0 if none */
+	uint32_t addr;								/* Remote IPv4 address */
+	int echo;									/* Echo status */
+	char name[MAX_NAME_LENGTH + 1];				/* Client name */
+	char room[MAX_NAME_LENGTH + 1];				/* Client room */
+	char status[MAX_SHORT_MESSAGE_LENGTH + 1];	/* User Status */
+	char mute[MAX_SHORT_MESSAGE_LENGTH + 1];	/* Mute List */
+} client_state_t;
+
+/* Encoded client state header, followed by name, room, status and mute list */
+typedef struct
+{
+	uint64_t token;
+	uint32_t addr;
+	uint8_t echo;
+	uint8_t name_len;
+	uint8_t room_len;
+	uint8_t pad;
+	uint16_t status_len;
+	uint16_t mute_len;
+} state_record_t;
+
+/* Snapshot file header, followed by the encoded client states */
+typedef struct
+{
+	char magic[4];
+	uint32_t count;
+} snapshot_header_t;
+
+/* Handoff header, sent with the listening socket */
+typedef struct
+{
+	char magic[4];
+	uint32_t count;
+} handoff_header_t;
+
+static int listen_fd = -1;
+static int handoff_fd = -1;
+static int handoff_active;
+static int handoff_parked;
+static pthread_t main_tid;
+static pthread_mutex_t handoff_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t handoff_cond = PTHREAD_COND_INITIALIZER;
+
+/* Federation frame types */
+enum
+{
+	FED_HELLO = 1,								/* Node id of the peer */
+	FED_STATE,									/* Rooms with members and names of a node */
+	FED_ROOM,									/* Room broadcast */
+	FED_DIRECT									/* Private message or bell */
+};
+
+/* Federation frame header, followed by the payload */
+typedef struct
+{
+	uint32_t len;								/* Payload length */
+	uint8_t type;								/* Frame type */
+	uint8_t ttl;								/* Hops left */
+	uint16_t pad;
+	uint32_t origin;							/* Node the frame comes from */
+	uint32_t seq;								/* Frame number at the origin */
+} fed_header_t;
+
+/* Link to a peer node */
+typedef struct
+{
+	int fd;										/* Socket, -1 if the slot is free */
+	int dead;									/* Broken, the flusher closes it */
+	uint32_t peer;								/* Node id, 0 until the peer said hello */
+	char *out;									/* Frames waiting for the flusher */
+	char *spare;								/* Batch being written */
+	size_t out_len;
+	size_t spare_len;
+	size_t sent;								/* Bytes of the batch the peer took so far */
+	unsigned long dropped;						/* Frames dropped because the peer lagged */
+} fed_link_t;
+
+/* What a node advertised */
+typedef struct
+{
+	uint32_t id;								/* Node id, 0 if unused */
+	uint32_t seq;								/* Latest advertisement */
+	int link;									/* Link the latest advertisement came through */
+	time_t seen;
+	int room_count;
+	int nick_count;
+	char rooms[MAX_ROOMS][MAX_NAME_LENGTH + 1];
+	char nicks[MAX_CLIENTS][MAX_NAME_LENGTH + 1];
+} fed_node_t;
+
+static uint32_t fed_node;
+static uint32_t fed_seq;
+static int fed_link_count;
+static volatile int fed_dirty;
+static int fed_listen_fd = -1;
+static char *fed_secret;						/* Shared by every node, sent in the hello */
+static fed_link_t fed_links[MAX_PEERS];
+static fed_node_t fed_nodes[MAX_FED_NODES];
+static uint64_t fed_seen_ids[FED_SEEN_SIZE];
+static pthread_mutex_t fed_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Shared registry row of a client, written only by the owning process */
+typedef struct
+{
+	_Atomic uint32_t seq;						/* Seqlock, odd while being written */
+	_Atomic uint32_t used;						/* Slot holds a client */
+	char name[MAX_NAME_LENGTH + 1];
+	char room[MAX_NAME_LENGTH + 1];
+	char status[MAX_SHORT_MESSAGE_LENGTH + 1];
+} shm_entry_t;
+
+/* Shared mirror of a local room */
+typedef struct
+{
+	_Atomic uint32_t seq;						/* Seqlock, odd while being written */
+	_Atomic uint32_t members;					/* Members in the owning process */
+	char name[MAX_NAME_LENGTH + 1];
+} shm_room_t;
+
+/* Message types between processes */
+enum
+{
+	SHM_ROOM = 1,								/* Room broadcast */
+	SHM_DIRECT									/* Private message or bell */
+};
+
+/* Ring slot */
+typedef struct
+{
+	_Atomic uint32_t seq;						/* Position the slot is ready for */
+	_Atomic uint32_t producer;					/* Pid of the process that claimed it, 0 if free */
+	int type;
+	char to[MAX_NAME_LENGTH + 1];				/* Room or recipient */
+	char name[MAX_NAME_LENGTH + 1];				/* Sender, for mute lists */
+	uint32_t len;
+	char text[MAX_HISTORY_MESSAGE_LENGTH];
+} shm_slot_t;
+
+/* Messages for one process, any process produces, the owner consumes */
+typedef struct
+{
+	_Atomic uint32_t head;
+	_Atomic uint32_t tail;
+	_Atomic uint32_t futex;						/* Bumped to wake the consumer */
+	_Atomic uint32_t sleeping;					/* Consumer waits on the futex */
+	shm_slot_t slots[SHM_RING_SLOTS];
+} shm_ring_t;
+
+/* Process slot */
+typedef struct
+{
+	_Atomic uint32_t pid;						/* Owner, 0 if free */
+	_Atomic uint32_t heartbeat;					/* Last time the owner was seen */
+	shm_entry_t entries[MAX_CLIENTS];			/* Indexed by uid */
+	shm_room_t rooms[MAX_ROOMS];				/* Indexed like the local room table */
+	shm_ring_t ring;
+} shm_proc_t;
 
-/* String compare case insensitive */
+/* Shared memory segment */
+typedef struct
+{
+	shm_proc_t procs[SHM_MAX_PROCS];
+} shm_segment_t;
+
+static shm_segment_t *shm_seg;
+static shm_proc_t *shm_self;
+static atomic_ulong shm_dropped;
+
+static int uring_fd = -1;
+static atomic_int uring_broken;					/* Set once a submit failed, the ring is not used again */
+static unsigned uring_entries;
+static unsigned *uring_sq_head;
+static unsigned *uring_sq_tail;
+static unsigned uring_sq_mask;
+static unsigned *uring_sq_array;
+static struct io_uring_sqe *uring_sqes;
+static unsigned *uring_cq_head;
+static unsigned *uring_cq_tail;
+static unsigned uring_cq_mask;
+static struct io_uring_cqe *uring_cqes;
+static char *uring_buf;
+static pthread_mutex_t uring_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static char snapshot_path[PATH_MAX];
+static client_state_t restore[MAX_CLIENTS];
+static int restore_claimed[MAX_CLIENTS];
+static int restore_count;
+static time_t restore_deadline;
+
+/* Compare a secret in time independent of where the strings differ */
+int secret_equal (const char *a, const char *b)
+{
+	size_t la = strlen (a), lb = strlen (b), i;
+	unsigned char d = la != lb;
+
+	for (i = 0; i < lb; i++)
+		d |= (unsigned char)a[i < la ? i : 0] ^ (unsigned char)b[i];
+
+	return !d;
+}
+
+/* String compare case insensitive. Names and commands are shorter than a vector,
+ * and a block load would read past the end of the smaller buffers */
 int strcicmp (char const *a, char const *b)
 {
 	for (;; a++, b++)
 	{
 		int d = tolower (*a) - tolower (*b);
 
-		if (d != 0 || !*a)
-			return d;
+		if (d != 0 || !*a)
+			return d;
+	}
+}
+
+/* Find the first CR, LF or NUL before end, end if there is none. Loads stay inside the buffer */
+char *scan_newline (char *s, const char *end)
+{
+	unsigned int mask;
+
+#if defined (__AVX2__)
+	const __m256i cr = _mm256_set1_epi8 ('\r'), lf = _mm256_set1_epi8 ('\n'), nul = _mm256_setzero_si256 ();
+	__m256i v;
+
+	for (; end - s >= 32; s += 32)
+	{
+		v = _mm256_loadu_si256 ((const __m256i *)s);
+		mask = _mm256_movemask_epi8 (_mm256_or_si256 (_mm256_or_si256 (_mm256_cmpeq_epi8 (v, cr), _mm256_cmpeq_epi8 (v, lf)), _mm256_cmpeq_epi8 (v, nul)));
+
+		if (mask)
+			return s + __builtin_ctz (mask);
+	}
+#elif defined (__SSE2__)
+	const __m128i cr = _mm_set1_epi8 ('\r'), lf = _mm_set1_epi8 ('\n'), nul = _mm_setzero_si128 ();
+	__m128i v;
+
+	for (; end - s >= 16; s += 16)
+	{
+		v = _mm_loadu_si128 ((const __m128i *)s);
+		mask = _mm_movemask_epi8 (_mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (v, cr), _mm_cmpeq_epi8 (v, lf)), _mm_cmpeq_epi8 (v, nul)));
+
+		if (mask)
+			return s + __builtin_ctz (mask);
+	}
+#else
+	(void)mask;
+#endif
+
+	while (s < end && *s != '\0' && *s != '\r' && *s != '\n')
+		s++;
+
+	return s;
+}
+
+/* Copy one character from *in to *out if it is printable and valid UTF-8, drop it otherwise */
+static inline void sanitize_step (unsigned char **in, const unsigned char *end, unsigned char **out)
+{
+	unsigned char *p = *in;
+	unsigned int c = *p, cp;
+	int n, i;
+
+	if (c < 0x80)
+	{
+		/* Control bytes, escape included, and DEL; tabs are kept */
+		if ((c >= 0x20 && c != 0x7F) || c == '\t')
+			*(*out)++ = c;
+
+		*in = p + 1;
+		return;
+	}
+
+	if (c >= 0xC2 && c <= 0xDF)
+		n = 2, cp = c & 0x1F;
+	else if (c >= 0xE0 && c <= 0xEF)
+		n = 3, cp = c & 0x0F;
+	else if (c >= 0xF0 && c <= 0xF4)
+		n = 4, cp = c & 0x07;
+	else
+		n = 0, cp = 0;
+
+	if (!n || end - p < n)
+	{
+		*in = p + 1;
+		return;
+	}
+
+	for (i = 1; i < n && (p[i] & 0xC0) == 0x80; i++)
+		cp = (cp << 6) | (p[i] & 0x3F);
+
+	/* Truncated, overlong, surrogate or out of range sequences lose their lead byte */
+	if (i < n || (n == 3 && (cp < 0x800 || (cp >= 0xD800 && cp <= 0xDFFF))) || (n == 4 && (cp < 0x10000 || cp > 0x10FFFF)))
+	{
+		*in = p + 1;
+		return;
+	}
+
+	/* C1 controls are dropped whole, terminals treat some as escapes */
+	if (cp >= 0xA0)
+	{
+		memmove (*out, p, n);
+		*out += n;
+	}
+
+	*in = p + n;
+}
+
+/* Drop control bytes and invalid UTF-8 from s in place, returns the new length */
+size_t text_sanitize (char *s, size_t len)
+{
+	unsigned char *in = (unsigned char *)s, *out = in;
+	const unsigned char *end = in + len;
+
+#if defined (__AVX2__)
+	while (end - in >= 32)
+	{
+		__m256i v = _mm256_loadu_si256 ((const __m256i *)in);
+		const unsigned char *stop;
+
+		/* As signed bytes everything outside 0x20 to 0x7E is below 0x20 or equal to 0x7F */
+		if (!_mm256_movemask_epi8 (_mm256_or_si256 (_mm256_cmpgt_epi8 (_mm256_set1_epi8 (0x20), v), _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 (0x7F)))))
+		{
+			if (out != in)
+				memmove (out, in, 32);
+
+			in += 32;
+			out += 32;
+			continue;
+		}
+
+		stop = in + 32; /* Steps may run past stop, never past end */
+		while (in < stop)
+			sanitize_step (&in, end, &out);
+	}
+#elif defined (__SSE2__)
+	while (end - in >= 16)
+	{
+		__m128i v = _mm_loadu_si128 ((const __m128i *)in);
+		const unsigned char *stop;
+
+		/* As signed bytes everything outside 0x20 to 0x7E is below 0x20 or equal to 0x7F */
+		if (!_mm_movemask_epi8 (_mm_or_si128 (_mm_cmplt_epi8 (v, _mm_set1_epi8 (0x20)), _mm_cmpeq_epi8 (v, _mm_set1_epi8 (0x7F)))))
+		{
+			if (out != in)
+				memmove (out, in, 16);
+
+			in += 16;
+			out += 16;
+			continue;
+		}
+
+		stop = in + 16; /* Steps may run past stop, never past end */
+		while (in < stop)
+			sanitize_step (&in, end, &out);
+	}
+#endif
+
+	while (in < end)
+		sanitize_step (&in, end, &out);
+
+	return out - (unsigned char *)s;
+}
+
+/* Terminate the first line of s, returns the start of the next line or NULL. The buffer ends at end */
+char *split_line (char *s, char *end)
+{
+	s = scan_newline (s, end);
+
+	while (s < end && (*s == '\r' || *s == '\n'))
+		*s++ = '\0';
+
+	return s < end && *s ? s : NULL;
+}
+
+/* First free client slot, -1 if every slot is in use. Only the accept loop adds clients, so it stays free until queue_add */
+int queue_free_slot (void)
+{
+	int i;
+	pthread_mutex_lock (&clients_mutex);
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		if (!clients[i])
+			break;
+	}
+
+	pthread_mutex_unlock (&clients_mutex);
+	return i < MAX_CLIENTS ? i : -1;
+}
+
+/* Mark the \who roster and the roster of a room stale */
+void roster_touch (room_t *rm)
+{
+	atomic_fetch_add_explicit (&roster_gen, 1, memory_order_relaxed);
+
+	if (rm)
+		atomic_fetch_add_explicit (&rm->roster_gen, 1, memory_order_relaxed);
+}
+
+/* Add client to queue, in the slot of its uid, and start its thread. The tid is set before others can see the client */
+void queue_add (client_t *cl, void *(*start) (void *))
+{
+	pthread_mutex_lock (&clients_mutex);
+	pthread_create (&cl->tid, NULL, start, (void *)cl);
+	clients[cl->uid] = cl;
+	atomic_fetch_add_explicit (&cli_count, 1, memory_order_relaxed);
+	roster_touch (NULL); /* The thread has yet to join a room, room_join marks that roster */
+	pthread_mutex_unlock (&clients_mutex);
+}
+
+/* Delete client from queue */
+void queue_delete (int uid)
+{
+	int i;
+	pthread_mutex_lock (&clients_mutex);
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		if (clients[i])
+		{
+			if (clients[i]->uid == uid)
+			{
+				roster_touch (clients[i]->rm);
+				clients[i] = NULL;
+				atomic_fetch_sub_explicit (&cli_count, 1, memory_order_relaxed);
+				break;
+			}
+		}
+	}
+
+	pthread_mutex_unlock (&clients_mutex);
+}
+
+/* Monotonic clock in nanoseconds for latency stamps */
+unsigned long lat_clock (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* Start a span, 0 when tracing is off */
+unsigned long trace_begin (void)
+{
+	return trace_on ? lat_clock () : 0;
+}
+
+/* Give a ring back when its thread exits, the events stay until overwritten */
+void trace_release (void *ring)
+{
+	atomic_store_explicit (&((trace_ring_t *)ring)->owner, 0, memory_order_release);
+}
+
+/* Find a ring for the calling thread, returns 0 if all are taken */
+int trace_attach (void)
+{
+	trace_event_t *events;
+	int i, expected;
+
+	if (trace_ring)
+		return 1;
+
+	if (trace_tid < 0)
+		return 0;
+
+	trace_tid = syscall (SYS_gettid);
+
+	for (i = 0; i < TRACE_THREADS; i++)
+	{
+		expected = 0;
+
+		if (atomic_compare_exchange_strong (&trace_rings[i].owner, &expected, trace_tid))
+		{
+			/* trace_dump skips a ring until its events are published */
+			if (!atomic_load_explicit (&trace_rings[i].events, memory_order_relaxed))
+			{
+				if (!(events = calloc (TRACE_RING_SIZE, sizeof (trace_event_t))))
+				{
+					atomic_store_explicit (&trace_rings[i].owner, 0, memory_order_release);
+					break;
+				}
+
+				atomic_store_explicit (&trace_rings[i].events, events, memory_order_release);
+			}
+
+			trace_ring = &trace_rings[i];
+			pthread_setspecific (trace_key, trace_ring);
+			return 1;
+		}
+	}
+
+	/* Do not search again on every span */
+	trace_tid = -1;
+	return 0;
+}
+
+/* Record a span started by trace_begin */
+void trace_end (const char *name, unsigned long start)
+{
+	trace_event_t *e, *events;
+	unsigned long head;
+
+	if (!start || !trace_attach ())
+		return;
+
+	head = atomic_load_explicit (&trace_ring->head, memory_order_relaxed);
+	events = atomic_load_explicit (&trace_ring->events, memory_order_relaxed);
+	e = &events[head & (TRACE_RING_SIZE - 1)];
+	e->name = name;
+	e->start = start;
+	e->dur = lat_clock () - start;
+	e->tid = trace_tid;
+	atomic_store_explicit (&trace_ring->head, head + 1, memory_order_release);
+}
+
+/* Write every ring as Chrome trace JSON, returns the number of events or -1 */
+long trace_dump (const char *path)
+{
+	trace_event_t *copy, *events;
+	unsigned long head, from, i;
+	long count = 0;
+	int r;
+	FILE *f;
+
+	if (!(f = fopen (path, "w")))
+		return -1;
+
+	if (!(copy = malloc (TRACE_RING_SIZE * sizeof (trace_event_t))))
+	{
+		fclose (f);
+		return -1;
+	}
+
+	fprintf (f, "{\"traceEvents\":[");
+
+	for (r = 0; r < TRACE_THREADS; r++)
+	{
+		if (!(events = atomic_load_explicit (&trace_rings[r].events, memory_order_acquire)))
+			continue;
+
+		head = atomic_load_explicit (&trace_rings[r].head, memory_order_acquire);
+		from = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+		for (i = from; i < head; i++)
+			copy[i & (TRACE_RING_SIZE - 1)] = events[i & (TRACE_RING_SIZE - 1)];
+
+		/* Skip what the owner may have overwritten while it was copied */
+		i = atomic_load_explicit (&trace_rings[r].head, memory_order_acquire);
+
+		if (i + 1 > from + TRACE_RING_SIZE)
+			from = i + 1 - TRACE_RING_SIZE;
+
+		for (i = from; i < head; i++)
+		{
+			trace_event_t *e = &copy[i & (TRACE_RING_SIZE - 1)];
+
+			fprintf (f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lu.%03lu,\"dur\":%lu.%03lu,\"pid\":%d,\"tid\":%d}",
+				count ? "," : "", e->name, e->start / 1000, e->start % 1000, e->dur / 1000, e->dur % 1000, getpid (), e->tid);
+			count++;
+		}
+	}
+
+	fprintf (f, "\n],\"displayTimeUnit\":\"ns\"}\n");
+	free (copy);
+
+	if (fclose (f))
+		return -1;
+
+	return count;
+}
+
+void lat_add (lat_stat_t *l, unsigned long ns)
+{
+	unsigned long max = atomic_load_explicit (&l->max, memory_order_relaxed);
+
+	atomic_fetch_add_explicit (&l->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit (&l->total, ns, memory_order_relaxed);
+
+	while (ns > max && !atomic_compare_exchange_weak_explicit (&l->max, &max, ns, memory_order_relaxed, memory_order_relaxed))
+		;
+}
+
+/* Count a stage in the totals and, if known, for the client */
+void lat_record (client_t *cli, int stage, unsigned long ns)
+{
+	lat_add (&lat_total[stage], ns);
+
+	if (cli)
+		lat_add (&cli->lat[stage], ns);
+}
+
+/* Format the average and maximum of a stage in microseconds */
+void lat_format (char *s, const lat_stat_t *l)
+{
+	unsigned long count = atomic_load_explicit (&l->count, memory_order_relaxed);
+	unsigned long total = atomic_load_explicit (&l->total, memory_order_relaxed);
+	unsigned long max = atomic_load_explicit (&l->max, memory_order_relaxed);
+
+	sprintf (s, "%lu/%lu", count ? total / count / 1000 : 0, max / 1000);
+}
+
+/* Mark the start or the end of a blocking write for the stall check */
+void write_stamp (int fd, int begin)
+{
+	unsigned long now;
+
+	if (fd < 0 || fd >= WATCH_FDS)
+		return;
+
+	now = atomic_load_explicit (&timer_ticks, memory_order_relaxed);
+
+	if (begin)
+	{
+		atomic_store_explicit (&write_since[fd], now, memory_order_relaxed);
+	}
+	else
+	{
+		atomic_store_explicit (&write_since[fd], 0, memory_order_relaxed);
+		atomic_store_explicit (&write_done[fd], now, memory_order_relaxed);
+	}
+}
+
+/* Write straight to the socket, returns the bytes written or -1 if none were */
+ssize_t socket_write (int fd, const char *s, size_t len)
+{
+	unsigned long t = trace_begin ();
+	ssize_t n;
+	size_t done = 0;
+
+	write_stamp (fd, 1);
+
+	/* The handoff signal interrupts writes, carry on after it and after short writes */
+	while (done < len)
+	{
+		n = write (fd, s + done, len - done);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0)
+			break;
+
+		done += n;
+	}
+
+	write_stamp (fd, 0);
+	trace_end ("write", t);
+	return done ? (ssize_t)done : -1;
+}
+
+/* Write out the coalesced output of a client. Call with out_mutex held */
+void client_flush_locked (client_t *cli)
+{
+	if (cli->out_len && cli->connfd >= 0)
+	{
+		socket_write (cli->connfd, cli->out, cli->out_len);
+		lat_record (cli, LAT_FLUSH, lat_clock () - cli->out_since);
+	}
+
+	cli->out_len = 0;
+}
+
+/* Write out the coalesced output of a client */
+void client_flush (client_t *cli)
+{
+	if (!cli->out)
+		return;
+
+	pthread_mutex_lock (&cli->out_mutex);
+	client_flush_locked (cli);
+	pthread_mutex_unlock (&cli->out_mutex);
+}
+
+/* Write what the socket takes without blocking, the rest waits for the next round. Call with out_mutex held */
+void client_flush_nowait (client_t *cli)
+{
+	unsigned long t = trace_begin ();
+	ssize_t n;
+
+	if (!cli->out_len || cli->connfd < 0)
+		return;
+
+	n = send (cli->connfd, cli->out, cli->out_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		n = 0;
+
+	/* A failed socket loses its output like with write () */
+	if (n < 0 || (size_t)n == cli->out_len)
+	{
+		if (n > 0)
+			lat_record (cli, LAT_FLUSH, lat_clock () - cli->out_since);
+
+		cli->out_len = 0;
+	}
+	else if (n > 0)
+	{
+		memmove (cli->out, cli->out + n, cli->out_len - n);
+		cli->out_len -= n;
+	}
+
+	trace_end ("write", t);
+}
+
+/* Flush the output and close the socket, later writes to the client are dropped */
+void client_close (client_t *cli)
+{
+	int fd;
+
+	pthread_mutex_lock (&cli->out_mutex);
+	client_flush_locked (cli);
+	fd = cli->connfd;
+	cli->connfd = -1;
+	pthread_mutex_unlock (&cli->out_mutex);
+	close (fd);
+}
+
+/* Send to one client, queued until the next flush when output coalescing is on */
+void client_write (client_t *cli, const char *s, size_t len)
+{
+	if (!cli->out)
+	{
+		socket_write (cli->connfd, s, len);
+		return;
+	}
+
+	pthread_mutex_lock (&cli->out_mutex);
+
+	/* Keep order when the buffer fills up, flush what is queued first */
+	if (cli->out_len + len > COALESCE_BUFFER_SIZE)
+		client_flush_locked (cli);
+
+	if (len > COALESCE_BUFFER_SIZE)
+	{
+		socket_write (cli->connfd, s, len);
+	}
+	else
+	{
+		if (!cli->out_len)
+			cli->out_since = lat_clock ();
+
+		memcpy (cli->out + cli->out_len, s, len);
+		cli->out_len += len;
+	}
+
+	pthread_mutex_unlock (&cli->out_mutex);
+}
+
+/* Flush every client once per coalescing window */
+void *coalesce_flusher (void *arg)
+{
+	client_t *pending[MAX_CLIENTS];
+	int i, n;
+
+	while (1)
+	{
+		usleep (coalesce_window);
+		n = 0;
+		pthread_mutex_lock (&clients_mutex);
+
+		for (i = 0; i < MAX_CLIENTS; i++)
+		{
+			if (clients[i] && clients[i]->out_len)
+			{
+				atomic_fetch_add_explicit (&clients[i]->refs, 1, memory_order_relaxed);
+				pending[n++] = clients[i];
+			}
+		}
+
+		pthread_mutex_unlock (&clients_mutex);
+
+		/* Writes happen outside clients_mutex and never block, a client busy writing is left for the next round */
+		for (i = 0; i < n; i++)
+		{
+			if (!pthread_mutex_trylock (&pending[i]->out_mutex))
+			{
+				client_flush_nowait (pending[i]);
+				pthread_mutex_unlock (&pending[i]->out_mutex);
+			}
+
+			atomic_fetch_sub_explicit (&pending[i]->refs, 1, memory_order_release);
+		}
+	}
+
+	return NULL;
+}
+
+/* Give a client its output buffer if coalescing is on */
+void client_output_init (client_t *cli)
+{
+	cli->out = coalesce_window ? malloc (COALESCE_BUFFER_SIZE) : NULL;
+	cli->out_len = 0;
+	pthread_mutex_init (&cli->out_mutex, NULL);
+	atomic_init (&cli->refs, 0);
+}
+
+/* Send message to sender */
+void send_message_self (const char *s, client_t *cli)
+{
+	unsigned long t = trace_begin ();
+
+	client_write (cli, s, strlen (s));
+	trace_end ("send_message_self", t);
+}
+
+/* Coarse monotonic clock in milliseconds, cheap enough for every input line */
+unsigned long rate_clock (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+/* Start a client with full buckets */
+void rate_init (client_t *cli)
+{
+	unsigned long now = rate_clock ();
+	int i;
+
+	for (i = 0; i < RATE_CLASSES; i++)
+	{
+		cli->bucket[i].tokens = rate_limits[i].burst * 1000UL;
+		cli->bucket[i].stamp = now;
+	}
+
+	cli->throttled = 0;
+	cli->spam_count = 0;
+	cli->spam_conn = atomic_fetch_add (&spam_conns, 1) + 1;
+	cli->spammed = 0;
+}
+
+/* Take a token of a class, returns 0 and tells the client once if the bucket is empty */
+int rate_check (client_t *cli, int cls)
+{
+	const rate_limit_t *lim;
+	bucket_t *b;
+	unsigned long now;
+
+	if (cls < 0 || !rate_limits[cls].rate)
+		return 1;
+
+	lim = &rate_limits[cls];
+	b = &cli->bucket[cls];
+	now = rate_clock ();
+	b->tokens += (now - b->stamp) * lim->rate;
+	b->stamp = now;
+
+	if (b->tokens > lim->burst * 1000UL)
+		b->tokens = lim->burst * 1000UL;
+
+	if (b->tokens >= 1000)
+	{
+		b->tokens -= 1000;
+		cli->throttled = 0;
+		return 1;
+	}
+
+	atomic_fetch_add_explicit (&rate_throttled[cls], 1, memory_order_relaxed);
+
+	if (!cli->throttled)
+	{
+		cli->throttled = 1;
+		send_message_self ("\r\n\x1B[33mRATE LIMITED\x1B[37m Slow down, input is being dropped\r\n\r\n", cli);
+	}
+
+	return 0;
+}
+
+/* Parse a -r setting, class=rate/burst */
+int rate_parse (const char *s)
+{
+	char name[16];
+	unsigned int rate, burst;
+	int i;
+
+	if (sscanf (s, "%15[^=]=%u/%u", name, &rate, &burst) != 3)
+		return -1;
+
+	for (i = 0; i < RATE_CLASSES; i++)
+	{
+		if (!strcicmp (name, rate_limits[i].name))
+		{
+			rate_limits[i].rate = rate;
+			rate_limits[i].burst = burst ? burst : 1;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/* Count a connection from addr, returns 0 if the address is over its limits.
+ * Resumed connections are counted without being checked */
+int admit_take (uint32_t addr, int check)
+{
+	admit_entry_t *e, *idle = NULL, *oldest = NULL;
+	unsigned long now = rate_clock ();
+	unsigned long cap = admit_limit.burst * 1000UL;
+	uint32_t h = addr * 2654435761u;
+	int i, ok = 1;
+
+	pthread_mutex_lock (&admit_mutex);
+
+	/* Linear probing, an entry without connections and with a full bucket can be reused */
+	for (i = 0; i < ADMIT_PROBES; i++)
+	{
+		e = &admit_table[(h + i) & (ADMIT_TABLE_SIZE - 1)];
+
+		if (e->addr == addr && (e->conns || e->accepts.stamp))
+			break;
+
+		if (!idle && !e->conns && (!e->accepts.stamp
+			|| !admit_limit.rate || (now - e->accepts.stamp) * admit_limit.rate >= cap))
+			idle = e;
+
+		if (!e->conns && (!oldest || e->accepts.stamp < oldest->accepts.stamp))
+			oldest = e;
+	}
+
+	/* Without an idle entry the least recently used address without connections loses its rate history.
+	   Entries with connections are never taken, their owner would get a fresh allowance */
+	if (i == ADMIT_PROBES)
+	{
+		if (!(e = idle ? idle : oldest))
+		{
+			if (check)
+				admit_rejected++;
+
+			pthread_mutex_unlock (&admit_mutex);
+			return !check;
+		}
+
+		e->addr = addr;
+		e->conns = 0;
+		e->accepts.tokens = cap;
+		e->accepts.stamp = now;
+	}
+
+	if (check)
+	{
+		if (admit_limit.rate)
+		{
+			e->accepts.tokens += (now - e->accepts.stamp) * admit_limit.rate;
+
+			if (e->accepts.tokens > cap)
+				e->accepts.tokens = cap;
+		}
+
+		e->accepts.stamp = now;
+
+		if (e->conns >= admit_max_conns || (admit_limit.rate && e->accepts.tokens < 1000))
+			ok = 0;
+		else if (admit_limit.rate)
+			e->accepts.tokens -= 1000;
+	}
+
+	if (ok)
+		e->conns++;
+	else
+		admit_rejected++;
+
+	pthread_mutex_unlock (&admit_mutex);
+	return ok;
+}
+
+/* Forget a closed connection from addr */
+void admit_release (uint32_t addr)
+{
+	admit_entry_t *e;
+	uint32_t h = addr * 2654435761u;
+	int i;
+
+	pthread_mutex_lock (&admit_mutex);
+
+	for (i = 0; i < ADMIT_PROBES; i++)
+	{
+		e = &admit_table[(h + i) & (ADMIT_TABLE_SIZE - 1)];
+
+		if (e->addr == addr && e->conns)
+		{
+			e->conns--;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock (&admit_mutex);
+}
+
+/* Parse a -A setting, conns/rate/burst */
+int admit_parse (const char *s)
+{
+	unsigned int conns, rate, burst;
+
+	if (sscanf (s, "%u/%u/%u", &conns, &rate, &burst) != 3 || !conns)
+		return -1;
+
+	admit_max_conns = conns;
+	admit_limit.rate = rate;
+	admit_limit.burst = burst ? burst : 1;
+	return 0;
+}
+
+/* Send the rate limit settings and throttle counters */
+void send_rate_stats (client_t *cli)
+{
+	char buff_out[MAX_SHORT_MESSAGE_LENGTH + 64];
+	int i;
+
+	for (i = 0; i < RATE_CLASSES; i++)
+	{
+		if (!rate_limits[i].rate)
+			sprintf (buff_out, "\x1B[33mLIMIT\x1B[37m %-4s off\r\n", rate_limits[i].name);
+		else
+			sprintf (buff_out, "\x1B[33mLIMIT\x1B[37m %-4s %u/s burst %u, %lu throttled\r\n", rate_limits[i].name,
+				rate_limits[i].rate, rate_limits[i].burst, atomic_load_explicit (&rate_throttled[i], memory_order_relaxed));
+
+		send_message_self (buff_out, cli);
+	}
+
+	pthread_mutex_lock (&admit_mutex);
+	sprintf (buff_out, "\x1B[33mADMIT\x1B[37m %u per address, %u/s burst %u, %lu refused\r\n",
+		admit_max_conns, admit_limit.rate, admit_limit.burst, admit_rejected);
+	pthread_mutex_unlock (&admit_mutex);
+	send_message_self (buff_out, cli);
+	if (!spam_sender_repeats && !spam_global_repeats)
+		sprintf (buff_out, "\x1B[33mSPAM\x1B[37m off\r\n");
+	else
+		sprintf (buff_out, "\x1B[33mSPAM\x1B[37m %u own, %u others in %lus, %lu dropped\r\n",
+			spam_sender_repeats, spam_global_repeats, spam_window / 1000, atomic_load_explicit (&spam_dropped, memory_order_relaxed));
+
+	send_message_self (buff_out, cli);
+}
+
+/* Send latency per stage and TCP state of every local connection, times in microseconds */
+void send_latency_stats (client_t *cli)
+{
+	char buff_out[MAX_NAME_LENGTH + 256];
+	char stage[LAT_STAGES][48];
+	struct tcp_info ti;
+	socklen_t len;
+	size_t used = 0;
+	char *text;
+	int i, x;
+
+	sprintf (buff_out, "\x1B[33mLATENCY\x1B[37m avg/max usec, %s %s %s %s\r\n", lat_names[0], lat_names[1], lat_names[2], lat_names[3]);
+	send_message_self (buff_out, cli);
+
+	for (x = 0; x < LAT_STAGES; x++)
+		lat_format (stage[x], &lat_total[x]);
+
+	sprintf (buff_out, "  %-16s %s %s %s %s\r\n", "ALL", stage[0], stage[1], stage[2], stage[3]);
+	send_message_self (buff_out, cli);
+
+	/* Clients may leave meanwhile, render under the lock and write once it is released */
+	text = malloc (MAX_CLIENTS * sizeof (buff_out));
+
+	if (!text)
+		return;
+
+	pthread_mutex_lock (&clients_mutex);
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		if (clients[i])
+		{
+			len = sizeof (ti);
+			memset (&ti, 0, sizeof (ti));
+			getsockopt (clients[i]->connfd, IPPROTO_TCP, TCP_INFO, &ti, &len);
+
+			for (x = 0; x < LAT_STAGES; x++)
+				lat_format (stage[x], &clients[i]->lat[x]);
+
+			used += sprintf (text + used, "  %-16s %s %s %s %s rtt %u/%u unacked %u retrans %u\r\n", clients[i]->name,
+				stage[0], stage[1], stage[2], stage[3], ti.tcpi_rtt, ti.tcpi_rttvar, ti.tcpi_unacked, ti.tcpi_total_retrans);
+		}
+	}
+
+	pthread_mutex_unlock (&clients_mutex);
+	client_write (cli, text, used);
+	free (text);
+}
+
+/* Link a timer into the wheel. Call with wheel_mutex held */
+void wheel_add_locked (wheel_timer_t *t, unsigned long expires)
+{
+	wheel_timer_t *head;
+	unsigned long delta;
+
+	if ((long)(expires - wheel_now) <= 0)
+		expires = wheel_now + 1;
+
+	delta = expires - wheel_now;
+
+	if (delta >= (WHEEL_SLOTS - 1) * WHEEL_SLOTS)
+		expires = wheel_now + (WHEEL_SLOTS - 1) * WHEEL_SLOTS - 1;
+
+	/* Near timers go straight to their tick, far ones wait in the upper level */
+	if (delta < WHEEL_SLOTS)
+		head = &wheel[0][expires & (WHEEL_SLOTS - 1)];
+	else
+		head = &wheel[1][(expires / WHEEL_SLOTS) & (WHEEL_SLOTS - 1)];
+
+	t->expires = expires;
+	t->next = head;
+	t->prev = head->prev;
+	head->prev->next = t;
+	head->prev = t;
+}
+
+/* Unlink a timer. Call with wheel_mutex held */
+void wheel_del_locked (wheel_timer_t *t)
+{
+	if (!t->next)
+		return;
+
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+}
+
+/* Arm a timer to fire after ticks */
+void wheel_add (wheel_timer_t *t, unsigned long ticks)
+{
+	pthread_mutex_lock (&wheel_mutex);
+	wheel_del_locked (t);
+	wheel_add_locked (t, wheel_now + ticks);
+	pthread_mutex_unlock (&wheel_mutex);
+}
+
+/* Disarm a timer, it does not fire once this returns */
+void wheel_del (wheel_timer_t *t)
+{
+	pthread_mutex_lock (&wheel_mutex);
+	wheel_del_locked (t);
+	pthread_mutex_unlock (&wheel_mutex);
+}
+
+/* Run one tick, moving the upper level slot down when the lower level wraps. Call with wheel_mutex held */
+void wheel_tick (void)
+{
+	wheel_timer_t *head, *t;
+
+	wheel_now++;
+
+	if (!(wheel_now & (WHEEL_SLOTS - 1)))
+	{
+		head = &wheel[1][(wheel_now / WHEEL_SLOTS) & (WHEEL_SLOTS - 1)];
+
+		while ((t = head->next) != head)
+		{
+			wheel_del_locked (t);
+			wheel_add_locked (t, t->expires);
+		}
+	}
+
+	/* Callbacks run with the lock held and may rearm themselves */
+	head = &wheel[0][wheel_now & (WHEEL_SLOTS - 1)];
+
+	while ((t = head->next) != head)
+	{
+		wheel_del_locked (t);
+		t->fn (t, wheel_now);
+	}
+}
+
+/* Empty the wheel, ticks start at 1 so 0 can mean unset */
+void wheel_init (void)
+{
+	int i, x;
+
+	for (i = 0; i < WHEEL_LEVELS; i++)
+		for (x = 0; x < WHEEL_SLOTS; x++)
+			wheel[i][x].next = wheel[i][x].prev = &wheel[i][x];
+
+	wheel_now = 1;
+	atomic_store_explicit (&timer_ticks, wheel_now, memory_order_relaxed);
+}
+
+/* Drive the wheel from the clock, one thread for every timer */
+void *wheel_runner (void *arg)
+{
+	unsigned long start = rate_clock ();
+	int active;
+
+	while (1)
+	{
+		usleep (TIMER_TICK * 1000);
+
+		/* Sockets may be on their way to a new process, leave them alone */
+		pthread_mutex_lock (&handoff_mutex);
+		active = handoff_active;
+		pthread_mutex_unlock (&handoff_mutex);
+
+		if (active)
+			continue;
+
+		pthread_mutex_lock (&wheel_mutex);
+
+		while ((long)((rate_clock () - start) / TIMER_TICK + 1 - wheel_now) > 0)
+			wheel_tick ();
+
+		atomic_store_explicit (&timer_ticks, wheel_now, memory_order_relaxed);
+		pthread_mutex_unlock (&wheel_mutex);
+	}
+
+	return NULL;
+}
+
+/* Drop, ping or recheck a client, runs on the wheel thread so it must not block */
+void client_timer (wheel_timer_t *t, unsigned long now)
+{
+	static const char idle_notice[] = "\r\n\x1B[33mIDLE TIMEOUT\x1B[37m\r\n\r\n";
+	static const char keepalive_probe[] = "\x1B[37m";	/* Invisible, sets the default color */
+	client_t *cli = t->arg;
+	int fd = cli->connfd;
+	unsigned long since = 0, done = now, input, next = ULONG_MAX;
+
+	if (fd < WATCH_FDS)
+	{
+		since = atomic_load_explicit (&write_since[fd], memory_order_relaxed);
+		done = atomic_load_explicit (&write_done[fd], memory_order_relaxed);
+	}
+
+	input = atomic_load_explicit (&cli->last_input, memory_order_relaxed);
+
+	/* A shut down socket wakes the client thread, which cleans up as usual */
+	if (stall_timeout && since && now - since >= stall_timeout)
+	{
+		shutdown (fd, SHUT_RDWR);
+		return;
+	}
+
+	if (idle_timeout && now - input >= idle_timeout)
+	{
+		send (fd, idle_notice, sizeof (idle_notice) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+		shutdown (fd, SHUT_RDWR);
+		return;
+	}
+
+	/* Writing to a dead peer is what makes the kernel give up on it */
+	if (keepalive_interval && !since && now - done >= keepalive_interval)
+	{
+		send (fd, keepalive_probe, sizeof (keepalive_probe) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+		done = now;
+
+		if (fd < WATCH_FDS)
+			atomic_store_explicit (&write_done[fd], now, memory_order_relaxed);
+	}
+
+	if (stall_timeout)
+		next = stall_timeout;
+
+	if (idle_timeout && input + idle_timeout - now < next)
+		next = input + idle_timeout - now;
+
+	if (keepalive_interval && done + keepalive_interval - now < next)
+		next = done + keepalive_interval - now;
+
+	wheel_add_locked (t, now + next);
+}
+
+/* Start watching a client */
+void client_timer_start (client_t *cli)
+{
+	unsigned long now = atomic_load_explicit (&timer_ticks, memory_order_relaxed);
+
+	atomic_store_explicit (&cli->last_input, now, memory_order_relaxed);
+	cli->timer.next = NULL;
+
+	if (cli->connfd < WATCH_FDS)
+	{
+		atomic_store_explicit (&write_since[cli->connfd], 0, memory_order_relaxed);
+		atomic_store_explicit (&write_done[cli->connfd], now, memory_order_relaxed);
+	}
+
+	if (!idle_timeout && !keepalive_interval && !stall_timeout)
+		return;
+
+	cli->timer.fn = client_timer;
+	cli->timer.arg = cli;
+	wheel_add (&cli->timer, 1);
+}
+
+/* SimHash of the letters and digits of a message, case folded, over a rolling window of 4 bytes. 0 if it is too short */
+uint64_t spam_fingerprint (const char *s)
+{
+	int weight[64] = {0};
+	uint32_t window = 0;
+	uint64_t h, print = 0;
+	int len = 0, b;
+
+	for (; *s; s++)
+	{
+		unsigned char c = *s;
+
+		/* Spacing, punctuation and case are the cheapest things to vary */
+		if (!isalnum (c) && c < 0x80)
+			continue;
+
+		window = (window << 8) | tolower (c);
+
+		if (++len < 4)
+			continue;
+
+		/* splitmix64 finalizer spreads the shingle over every bit */
+		h = window + 0x9E3779B97F4A7C15ULL;
+		h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+		h ^= h >> 31;
+
+		for (b = 0; b < 64; b++)
+			weight[b] += (h >> b) & 1 ? 1 : -1;
+	}
+
+	if (len < SPAM_MIN_LENGTH)
+		return 0;
+
+	for (b = 0; b < 64; b++)
+		if (weight[b] > 0)
+			print |= 1ULL << b;
+
+	return print ? print : 1;
+}
+
+/* Check a room message against the recent messages of the client and of everyone, returns 0 and tells the client once if it is spam */
+int spam_check (client_t *cli, const char *s)
+{
+	uint64_t print;
+	unsigned long now;
+	unsigned int own = 0, others = 0, i, n;
+	spam_print_t *p;
+
+	if (!spam_sender_repeats && !spam_global_repeats)
+		return 1;
+
+	if (!(print = spam_fingerprint (s)))
+		return 1;
+
+	now = rate_clock ();
+	n = cli->spam_count < SPAM_SENDER_WINDOW ? cli->spam_count : SPAM_SENDER_WINDOW;
+
+	/* Only this thread touches the ring of its client */
+	for (i = 0; i < n; i++)
+		if (now - cli->spam[i].stamp < spam_window && __builtin_popcountll (print ^ cli->spam[i].print) <= SPAM_DISTANCE)
+			own++;
+
+	p = &cli->spam[cli->spam_count++ % SPAM_SENDER_WINDOW];
+	p->print = print;
+	p->stamp = now;
+	p->conn = cli->spam_conn;
+
+	/* Dropped messages go in the windows too, a spammer stays caught while repeating */
+	pthread_mutex_lock (&spam_mutex);
+
+	for (i = 0; i < SPAM_GLOBAL_WINDOW; i++)
+		if (spam_recent[i].stamp && spam_recent[i].conn != cli->spam_conn && now - spam_recent[i].stamp < spam_window
+			&& __builtin_popcountll (print ^ spam_recent[i].print) <= SPAM_DISTANCE)
+			others++;
+
+	spam_recent[spam_next++ % SPAM_GLOBAL_WINDOW] = *p;
+	pthread_mutex_unlock (&spam_mutex);
+
+	if ((!spam_sender_repeats || own < spam_sender_repeats) && (!spam_global_repeats || others < spam_global_repeats))
+	{
+		cli->spammed = 0;
+		return 1;
+	}
+
+	atomic_fetch_add_explicit (&spam_dropped, 1, memory_order_relaxed);
+
+	if (!cli->spammed)
+	{
+		cli->spammed = 1;
+		send_message_self ("\r\n\x1B[33mDUPLICATE DROPPED\x1B[37m Repeated messages are not sent\r\n\r\n", cli);
+	}
+
+	return 0;
+}
+
+/* Parse a -d setting, sender/global/seconds */
+int spam_parse (const char *s)
+{
+	unsigned int sender, global, window;
+
+	if (sscanf (s, "%u/%u/%u", &sender, &global, &window) != 3)
+		return -1;
+
+	spam_sender_repeats = sender;
+	spam_global_repeats = global;
+	spam_window = window * 1000UL;
+	return 0;
+}
+
+/* Parse a -t setting, idle/keepalive/stall in seconds */
+int timer_parse (const char *s)
+{
+	unsigned int idle, keepalive, stall;
+
+	if (sscanf (s, "%u/%u/%u", &idle, &keepalive, &stall) != 3)
+		return -1;
+
+	idle_timeout = idle * 1000UL / TIMER_TICK;
+	keepalive_interval = keepalive * 1000UL / TIMER_TICK;
+	stall_timeout = stall * 1000UL / TIMER_TICK;
+	return 0;
+}
+
+/* Send message to specific client, regardless of room */
+void send_message_client (char *s, char *name, int uid)
+{
+	unsigned long t = trace_begin ();
+	client_t *cli = NULL;
+	int i;
+	char cmpname[MAX_NAME_LENGTH + 3];
+	strcpy (cmpname, "|");
+	strcat (cmpname, name);
+	strcat (cmpname, "|");
+
+	/* A reference keeps the recipient from being freed while we write outside the lock */
+	pthread_mutex_lock (&clients_mutex);
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		if (clients[i] && clients[i]->uid == uid && strcicmp (clients[i]->mute, cmpname))
+		{
+			cli = clients[i];
+			atomic_fetch_add_explicit (&cli->refs, 1, memory_order_relaxed);
+			break;
+		}
+	}
+
+	pthread_mutex_unlock (&clients_mutex);
+
+	if (cli)
+	{
+		client_write (cli, s, strlen (s));
+		atomic_fetch_sub_explicit (&cli->refs, 1, memory_order_release);
+	}
+
+	trace_end ("send_message_client", t);
+}
+
+/* Set up the io_uring used to submit fanout writes as one batch */
+int uring_init (void)
+{
+	struct io_uring_params p;
+	struct iovec iov;
+	size_t sq_size, cq_size;
+	char *sq, *cq;
+
+	memset (&p, 0, sizeof (p));
+	uring_fd = syscall (SYS_io_uring_setup, URING_ENTRIES, &p);
+
+	if (uring_fd < 0)
+		return -1;
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+
+	sq = mmap (NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring_fd, IORING_OFF_SQ_RING);
+
+	if (sq == MAP_FAILED)
+		return -1;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cq = sq;
+	else
+		cq = mmap (NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring_fd, IORING_OFF_CQ_RING);
+
+	uring_sqes = mmap (NULL, p.sq_entries * sizeof (struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring_fd, IORING_OFF_SQES);
+
+	if (cq == MAP_FAILED || uring_sqes == MAP_FAILED)
+		return -1;
+
+	uring_sq_head = (unsigned *)(sq + p.sq_off.head);
+	uring_sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	uring_sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	uring_sq_array = (unsigned *)(sq + p.sq_off.array);
+	uring_cq_head = (unsigned *)(cq + p.cq_off.head);
+	uring_cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	uring_cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	uring_cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	uring_entries = p.sq_entries;
+
+	/* The message is copied once into a registered buffer shared by every write of the batch */
+	uring_buf = mmap (NULL, URING_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	iov.iov_base = uring_buf;
+	iov.iov_len = URING_BUFFER_SIZE;
+
+	if (uring_buf == MAP_FAILED || syscall (SYS_io_uring_register, uring_fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0)
+		return -1;
+
+	return 0;
+}
+
+/* Write the same message to every socket, with io_uring a batch costs one syscall */
+void fanout_write (const int *fds, int n, const char *s, size_t len)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned long t;
+	unsigned tail, head, idx;
+	int i, x, batch, reaped, failed = 0, slow = 0;
+	int slow_fds[MAX_CLIENTS];
+	size_t slow_done[MAX_CLIENTS];
+
+	if (uring_fd < 0 || atomic_load_explicit (&uring_broken, memory_order_relaxed) || len > URING_BUFFER_SIZE)
+	{
+		for (i = 0; i < n; i++)
+			socket_write (fds[i], s, len);
+
+		return;
+	}
+
+	t = trace_begin ();
+	pthread_mutex_lock (&uring_mutex);
+
+	/* Another sender may have given up on the ring while we waited */
+	if (atomic_load_explicit (&uring_broken, memory_order_relaxed))
+	{
+		pthread_mutex_unlock (&uring_mutex);
+
+		for (i = 0; i < n; i++)
+			socket_write (fds[i], s, len);
+
+		trace_end ("uring_write", t);
+		return;
+	}
+
+	memcpy (uring_buf, s, len);
+
+	for (i = 0; i < n && !failed; i += batch)
+	{
+		batch = n - i < uring_entries ? n - i : uring_entries;
+		tail = *uring_sq_tail;
+
+		for (x = 0; x < batch; x++, tail++)
+		{
+			idx = tail & uring_sq_mask;
+			sqe = &uring_sqes[idx];
+			memset (sqe, 0, sizeof (*sqe));
+			sqe->opcode = IORING_OP_WRITE_FIXED;
+			sqe->fd = fds[i + x];
+			sqe->addr = (uintptr_t)uring_buf;
+			sqe->len = len;
+			sqe->buf_index = 0;
+			/* Fail with EAGAIN instead of waiting for a full socket, the lock is never held on a slow peer */
+			sqe->rw_flags = RWF_NOWAIT;
+			sqe->user_data = i + x;
+			uring_sq_array[idx] = idx;
+		}
+
+		atomic_store_explicit ((_Atomic unsigned *)uring_sq_tail, tail, memory_order_release);
+
+		/* Submit, then reap every completion of the batch before the buffer is reused */
+		for (reaped = 0, x = batch; reaped < batch; x = 0)
+		{
+			if (syscall (SYS_io_uring_enter, uring_fd, x, batch - reaped, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+			{
+				perror ("\x1B[34mio_uring submit failed\x1B[37m");
+				failed = 1;
+				break;
+			}
+
+			head = *uring_cq_head;
+
+			while (head != atomic_load_explicit ((_Atomic unsigned *)uring_cq_tail, memory_order_acquire))
+			{
+				cqe = &uring_cqes[head & uring_cq_mask];
+
+				/* Full or short writes are finished below with a blocking write of the rest */
+				if ((cqe->res == -EAGAIN || (cqe->res >= 0 && (size_t)cqe->res < len)) && slow < MAX_CLIENTS)
+				{
+					slow_fds[slow] = fds[cqe->user_data];
+					slow_done[slow++] = cqe->res > 0 ? cqe->res : 0;
+				}
+
+				head++;
+				reaped++;
+			}
+
+			atomic_store_explicit ((_Atomic unsigned *)uring_cq_head, head, memory_order_release);
+		}
+	}
+
+	/* Give up on the ring. Writes the kernel took may still read uring_buf, which is never written again.
+	   Entries it did not take and batches never submitted get plain writes */
+	if (failed)
+	{
+		atomic_store (&uring_broken, 1);
+
+		/* The failed batch started at i - batch, its entry at ring position head is fds[i - (tail - head)] */
+		for (head = atomic_load_explicit ((_Atomic unsigned *)uring_sq_head, memory_order_acquire); head != tail && slow < MAX_CLIENTS; head++)
+		{
+			slow_fds[slow] = fds[i - (tail - head)];
+			slow_done[slow++] = 0;
+		}
+
+		for (; i < n && slow < MAX_CLIENTS; i++)
+		{
+			slow_fds[slow] = fds[i];
+			slow_done[slow++] = 0;
+		}
+	}
+
+	pthread_mutex_unlock (&uring_mutex);
+
+	for (x = 0; x < slow; x++)
+		socket_write (slow_fds[x], s + slow_done[x], len - slow_done[x]);
+
+	trace_end ("uring_write", t);
+}
+
+/* Send message to every local client in a room except skip_uid, honouring mute lists */
+void room_fanout (const char *s, const char *room, const char *name, int skip_uid)
+{
+	unsigned long enqueued = lat_clock ();
+	unsigned long t = trace_begin ();
+	int i, n = 0, m = 0;
+	int fds[MAX_CLIENTS];
+	client_t *buffered[MAX_CLIENTS];
+	char cmpname[MAX_NAME_LENGTH + 3];
+	strcpy (cmpname, "|");
+	strcat (cmpname, name);
+	strcat (cmpname, "|");
+
+	/* Collect the recipients under the lock, references keep the buffered ones alive until written */
+	pthread_mutex_lock (&clients_mutex);
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		if (clients[i])
+		{
+			if (!strcicmp (clients[i]->room, room) && strcicmp (clients[i]->mute, cmpname))
+			{
+				if (clients[i]->uid != skip_uid)
+				{
+					/* Coalesced output is written by the flusher */
+					if (clients[i]->out)
+					{
+						atomic_fetch_add_explicit (&clients[i]->refs, 1, memory_order_relaxed);
+						buffered[m++] = clients[i];
+					}
+					else
+					{
+						fds[n++] = clients[i]->connfd;
+					}
+				}
+			}
+		}
+	}
+
+	pthread_mutex_unlock (&clients_mutex);
+
+	for (i = 0; i < m; i++)
+	{
+		client_write (buffered[i], s, strlen (s));
+		atomic_fetch_sub_explicit (&buffered[i]->refs, 1, memory_order_release);
+	}
+
+	if (lat_cli && lat_dispatch)
+		lat_record (lat_cli, LAT_DISPATCH, enqueued - lat_dispatch);
+
+	if (n)
+	{
+		fanout_write (fds, n, s, strlen (s));
+		lat_record (lat_cli, LAT_WRITE, lat_clock () - enqueued);
+	}
+
+	trace_end ("fanout", t);
+}
+
+/* Look up a local client by name, returns the uid or -1 */
+int client_find (const char *name)
+{
+	int i, uid = -1;
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		if (clients[i])
+		{
+			if (!strcicmp (clients[i]->name, name))
+				uid = clients[i]->uid;
+		}
+	}
+
+	return uid;
+}
+
+/* Note that local rooms or names changed, the flusher advertises it */
+void fed_changed (void)
+{
+	fed_dirty = 1;
+}
+
+/* Remember a frame id, returns 1 if it was seen already */
+int fed_seen (uint32_t origin, uint32_t seq)
+{
+	uint64_t key = ((uint64_t)origin << 32) | seq;
+	uint64_t *slot = &fed_seen_ids[(key * 0x9E3779B97F4A7C15ull) >> 52 & (FED_SEEN_SIZE - 1)];
+	int seen;
+
+	pthread_mutex_lock (&fed_mutex);
+	seen = *slot == key;
+	*slot = key;
+	pthread_mutex_unlock (&fed_mutex);
+	return seen;
+}
+
+/* Queue a frame on a link, dropped if the peer is too far behind. Call with fed_mutex held */
+void fed_queue (fed_link_t *link, const fed_header_t *hdr, const char *payload)
+{
+	if (link->fd < 0 || link->dead || !link->peer)
+		return;
+
+	if (link->out_len + sizeof (*hdr) + hdr->len > FED_LINK_BUFFER)
+	{
+		link->dropped++;
+		return;
+	}
+
+	memcpy (link->out + link->out_len, hdr, sizeof (*hdr));
+	memcpy (link->out + link->out_len + sizeof (*hdr), payload, hdr->len);
+	link->out_len += sizeof (*hdr) + hdr->len;
+}
+
+/* Forward a frame towards the nodes having the room or the name, never back where it came from */
+void fed_route (const fed_header_t *hdr, const char *payload, const char *room, const char *nick, int from)
+{
+	unsigned int links = 0;
+	int i, x;
+
+	pthread_mutex_lock (&fed_mutex);
+
+	for (i = 0; i < MAX_FED_NODES; i++)
+	{
+		fed_node_t *node = &fed_nodes[i];
+
+		if (!node->id || node->id == hdr->origin || node->link == from || (links & (1u << node->link)))
+			continue;
+
+		for (x = 0; room && x < node->room_count; x++)
+		{
+			if (!strcicmp (node->rooms[x], room))
+				links |= 1u << node->link;
+		}
+
+		for (x = 0; nick && x < node->nick_count; x++)
+		{
+			if (!strcicmp (node->nicks[x], nick))
+				links |= 1u << node->link;
+		}
+	}
+
+	for (i = 0; i < MAX_PEERS; i++)
+	{
+		if (links & (1u << i))
+			fed_queue (&fed_links[i], hdr, payload);
+	}
+
+	pthread_mutex_unlock (&fed_mutex);
+}
+
+/* Append a length prefixed string to a payload */
+char *fed_put (char *p, const char *s)
+{
+	size_t len = strlen (s);
+
+	if (len > 255)
+		len = 255;
+
+	*p++ = len;
+	memcpy (p, s, len);
+	return p + len;
+}
+
+/* Read a length prefixed string from a payload, returns NULL if truncated */
+const char *fed_get (const char *p, const char *end, char *s, size_t size)
+{
+	size_t len;
+
+	if (p >= end)
+		return NULL;
+
+	len = (unsigned char)*p++;
+
+	if (len > end - p || len >= size)
+		return NULL;
+
+	memcpy (s, p, len);
+	s[len] = '\0';
+	return p + len;
+}
+
+/* Build a frame originating here */
+void fed_header (fed_header_t *hdr, int type, size_t len)
+{
+	pthread_mutex_lock (&fed_mutex);
+	hdr->seq = ++fed_seq;
+	pthread_mutex_unlock (&fed_mutex);
+	hdr->len = len;
+	hdr->type = type;
+	hdr->ttl = FED_TTL;
+	hdr->pad = 0;
+	hdr->origin = fed_node;
+	fed_seen (hdr->origin, hdr->seq);
+}
+
+/* Forward a room broadcast to the peers that have members in the room */
+void fed_room (const char *s, const char *room, const char *name)
+{
+	char payload[FED_MAX_FRAME];
+	fed_header_t hdr;
+	char *p;
+
+	if (!fed_link_count)
+		return;
+
+	p = fed_put (payload, room);
+	p = fed_put (p, name);
+	memcpy (p, s, strlen (s));
+	fed_header (&hdr, FED_ROOM, p + strlen (s) - payload);
+	fed_route (&hdr, payload, room, NULL, -1);
+}
+
+/* Check if a client of that name is on another node */
+int fed_has_nick (const char *nick)
+{
+	int i, x, found = 0;
+
+	if (!fed_link_count)
+		return 0;
+
+	pthread_mutex_lock (&fed_mutex);
+
+	for (i = 0; i < MAX_FED_NODES; i++)
+	{
+		for (x = 0; fed_nodes[i].id && x < fed_nodes[i].nick_count; x++)
+		{
+			if (!strcicmp (fed_nodes[i].nicks[x], nick))
+				found = 1;
+		}
+	}
+
+	pthread_mutex_unlock (&fed_mutex);
+	return found;
+}
+
+/* Send to a client on another node */
+void fed_direct (const char *s, const char *nick, const char *name)
+{
+	char payload[FED_MAX_FRAME];
+	fed_header_t hdr;
+	char *p;
+
+	p = fed_put (payload, nick);
+	p = fed_put (p, name);
+	memcpy (p, s, strlen (s));
+	fed_header (&hdr, FED_DIRECT, p + strlen (s) - payload);
+	fed_route (&hdr, payload, NULL, nick, -1);
+}
+
+/* Advertise the rooms with local members and the local names to every node */
+void fed_advertise (void)
+{
+	char payload[FED_MAX_FRAME];
+	fed_header_t hdr;
+	char *p = payload + 2 * sizeof (uint16_t);
+	uint16_t count;
+	int i;
+
+	pthread_mutex_lock (&rooms_mutex);
+
+	for (i = 0, count = 0; i < MAX_ROOMS; i++)
+	{
+		if (rooms[i].members)
+		{
+			p = fed_put (p, rooms[i].name);
+			count++;
+		}
+	}
+
+	pthread_mutex_unlock (&rooms_mutex);
+	memcpy (payload, &count, sizeof (count));
+	pthread_mutex_lock (&clients_mutex);
+
+	for (i = 0, count = 0; i < MAX_CLIENTS; i++)
+	{
+		if (clients[i])
+		{
+			p = fed_put (p, clients[i]->name);
+			count++;
+		}
+	}
+
+	pthread_mutex_unlock (&clients_mutex);
+	memcpy (payload + sizeof (uint16_t), &count, sizeof (count));
+	fed_header (&hdr, FED_STATE, p - payload);
+	pthread_mutex_lock (&fed_mutex);
+
+	for (i = 0; i < MAX_PEERS; i++)
+		fed_queue (&fed_links[i], &hdr, payload);
+
+	pthread_mutex_unlock (&fed_mutex);
+}
+
+/* Store what a node advertised, learnt through the given link */
+void fed_learn (const fed_header_t *hdr, const char *payload, int from)
+{
+	const char *p = payload + 2 * sizeof (uint16_t), *end = payload + hdr->len;
+	fed_node_t *node = NULL, *spare = NULL;
+	uint16_t rooms_count, nicks_count;
+	int i;
+
+	if (hdr->len < 2 * sizeof (uint16_t))
+		return;
+
+	memcpy (&rooms_count, payload, sizeof (uint16_t));
+	memcpy (&nicks_count, payload + sizeof (uint16_t), sizeof (uint16_t));
+	pthread_mutex_lock (&fed_mutex);
+
+	for (i = 0; i < MAX_FED_NODES; i++)
+	{
+		if (fed_nodes[i].id == hdr->origin)
+			node = &fed_nodes[i];
+		else if (!fed_nodes[i].id && !spare)
+			spare = &fed_nodes[i];
+	}
+
+	if (!node && spare)
+	{
+		node = spare;
+		node->id = hdr->origin;
+		node->seq = 0;
+	}
+
+	/* Only a newer advertisement moves the route, the first copy came the quickest way */
+	if (node && (int32_t)(hdr->seq - node->seq) > 0)
+	{
+		node->seq = hdr->seq;
+		node->link = from;
+		node->seen = time (NULL);
+
+		for (node->room_count = 0; p && node->room_count < rooms_count && node->room_count < MAX_ROOMS; node->room_count++)
+			p = fed_get (p, end, node->rooms[node->room_count], MAX_NAME_LENGTH + 1);
+
+		for (node->nick_count = 0; p && node->nick_count < nicks_count && node->nick_count < MAX_CLIENTS; node->nick_count++)
+			p = fed_get (p, end, node->nicks[node->nick_count], MAX_NAME_LENGTH + 1);
+	}
+
+	pthread_mutex_unlock (&fed_mutex);
+}
+
+/* Handle a frame received from a peer */
+void fed_dispatch (fed_link_t *link, fed_header_t *hdr, const char *payload)
+{
+	char room[MAX_NAME_LENGTH + 1];
+	char name[MAX_NAME_LENGTH + 1];
+	char text[MAX_HISTORY_MESSAGE_LENGTH + 1];
+	const char *p, *end = payload + hdr->len;
+	int from = link - fed_links;
+	int uid;
+	size_t len;
+
+	if (hdr->type == FED_HELLO)
+	{
+		len = hdr->len < sizeof (text) - 1 ? hdr->len : sizeof (text) - 1;
+		memcpy (text, payload, len);
+		text[len] = '\0';
+		pthread_mutex_lock (&fed_mutex);
+
+		/* A link to ourselves would echo everything back, a peer without the secret is not one of ours */
+		if (hdr->origin == fed_node || (fed_secret && (len != hdr->len || !secret_equal (text, fed_secret))))
+			link->dead = 1;
+		else
+			link->peer = hdr->origin;
+
+		pthread_mutex_unlock (&fed_mutex);
+		fed_changed ();
+		return;
+	}
+
+	/* Nothing is taken from a peer before its hello */
+	if (!link->peer)
+	{
+		link->dead = 1;
+		return;
+	}
+
+	/* Loop prevention, every frame is handled once and lives for a few hops */
+	if (hdr->origin == fed_node || !hdr->ttl || fed_seen (hdr->origin, hdr->seq))
+		return;
+
+	hdr->ttl--;
+
+	switch (hdr->type)
+	{
+		case FED_STATE:
+			{
+				fed_learn (hdr, payload, from);
+				pthread_mutex_lock (&fed_mutex);
+
+				for (uid = 0; hdr->ttl && uid < MAX_PEERS; uid++)
+				{
+					if (uid != from)
+						fed_queue (&fed_links[uid], hdr, payload);
+				}
+
+				pthread_mutex_unlock (&fed_mutex);
+				break;
+			}
+
+		case FED_ROOM:
+		case FED_DIRECT:
+			{
+				if (!(p = fed_get (payload, end, room, sizeof (room))) || !(p = fed_get (p, end, name, sizeof (name))))
+					break;
+
+				len = end - p;
+
+				if (len > MAX_HISTORY_MESSAGE_LENGTH)
+					len = MAX_HISTORY_MESSAGE_LENGTH;
+
+				memcpy (text, p, len);
+				text[len] = '\0';
+
+				if (hdr->type == FED_ROOM)
+				{
+					room_fanout (text, room, name, -1);
+
+					if (hdr->ttl)
+						fed_route (hdr, payload, room, NULL, from);
+				}
+				else if ((uid = client_find (room)) != -1)
+				{
+					/* The room field holds the recipient */
+					send_message_client (text, name, uid);
+				}
+				else if (hdr->ttl)
+				{
+					fed_route (hdr, payload, NULL, room, from);
+				}
+
+				break;
+			}
+	}
+}
+
+/* Read exactly len bytes */
+int fed_read (int fd, void *buf, size_t len)
+{
+	size_t done = 0;
+	int rlen;
+
+	while (done < len)
+	{
+		rlen = read (fd, (char *)buf + done, len - done);
+
+		if (rlen <= 0)
+			return -1;
+
+		done += rlen;
+	}
+
+	return 0;
+}
+
+/* Take a free link slot for a connected socket */
+fed_link_t *fed_link_open (int fd)
+{
+	fed_link_t *link = NULL;
+	fed_header_t hdr;
+	int i;
+
+	pthread_mutex_lock (&fed_mutex);
+
+	for (i = 0; i < MAX_PEERS; i++)
+	{
+		if (fed_links[i].fd < 0)
+		{
+			link = &fed_links[i];
+			link->fd = fd;
+			link->peer = 0;
+			link->dead = 0;
+			link->out_len = 0;
+			link->spare_len = 0;
+			link->sent = 0;
+			fed_link_count++;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock (&fed_mutex);
+
+	if (!link)
+		return NULL;
+
+	/* Say who we are with the secret, written directly since the peer is unknown until it answers */
+	hdr.len = fed_secret ? strlen (fed_secret) : 0;
+	hdr.type = FED_HELLO;
+	hdr.ttl = 0;
+	hdr.pad = 0;
+	hdr.origin = fed_node;
+	hdr.seq = 0;
+
+	if (write (fd, &hdr, sizeof (hdr)) != sizeof (hdr) || (hdr.len && write (fd, fed_secret, hdr.len) != hdr.len))
+		link->dead = 1;
+
+	return link;
+}
+
+/* Receive frames from a link until it breaks, then close it. The reader owns the socket, the flusher only shuts it down */
+void fed_link_run (fed_link_t *link)
+{
+	char payload[FED_MAX_FRAME];
+	fed_header_t hdr;
+	int i, x;
+
+	while (!link->dead && !fed_read (link->fd, &hdr, sizeof (hdr)) && hdr.len <= FED_MAX_FRAME && !fed_read (link->fd, payload, hdr.len))
+		fed_dispatch (link, &hdr, payload);
+
+	pthread_mutex_lock (&fed_mutex);
+	i = link - fed_links;
+
+	/* Forget the routes learnt through the broken link */
+	for (x = 0; x < MAX_FED_NODES; x++)
+	{
+		if (fed_nodes[x].id && fed_nodes[x].link == i)
+			fed_nodes[x].id = 0;
+	}
+
+	close (link->fd);
+	link->fd = -1;
+	link->dead = 1;
+	fed_link_count--;
+	pthread_mutex_unlock (&fed_mutex);
+}
+
+/* Accepted peer connection */
+void *fed_peer (void *arg)
+{
+	fed_link_t *link = fed_link_open ((int)(intptr_t)arg);
+
+	if (link)
+		fed_link_run (link);
+	else
+		close ((int)(intptr_t)arg);
+
+	pthread_detach (pthread_self());
+	return NULL;
+}
+
+/* Accept peer connections */
+void *fed_acceptor (void *arg)
+{
+	int fd, one = 1;
+	pthread_t tid;
+
+	while (1)
+	{
+		fd = accept (fed_listen_fd, NULL, NULL);
+
+		if (fd < 0)
+			continue;
+
+		setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+		pthread_create (&tid, NULL, &fed_peer, (void *)(intptr_t)fd);
+	}
+
+	return NULL;
+}
+
+/* Keep a configured link up */
+void *fed_connector (void *arg)
+{
+	struct sockaddr_in *addr = (struct sockaddr_in *)arg;
+	fed_link_t *link;
+	int fd, one = 1;
+
+	while (1)
+	{
+		fd = socket (AF_INET, SOCK_STREAM, 0);
+
+		if (connect (fd, (struct sockaddr *)addr, sizeof (*addr)) == 0)
+		{
+			setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+
+			if ((link = fed_link_open (fd)))
+			{
+				fed_link_run (link);
+				fd = -1;
+			}
+		}
+
+		if (fd >= 0)
+			close (fd);
+
+		sleep (FED_RECONNECT_INTERVAL);
+	}
+
+	return NULL;
+}
+
+/* Batch queued frames into one write per link, advertise changes and expire silent nodes */
+void *fed_flusher (void *arg)
+{
+	time_t last_advertise = 0, now;
+	char *batch;
+	ssize_t n;
+	int i, x;
+
+	while (1)
+	{
+		usleep (FED_FLUSH_INTERVAL * 1000);
+		now = time (NULL);
+
+		if (fed_link_count && (fed_dirty || now - last_advertise >= FED_ADVERTISE_INTERVAL))
+		{
+			fed_dirty = 0;
+			last_advertise = now;
+			fed_advertise ();
+		}
+
+		for (i = 0; i < MAX_PEERS; i++)
+		{
+			fed_link_t *link = &fed_links[i];
+			pthread_mutex_lock (&fed_mutex);
+
+			if (link->fd < 0 || link->dead)
+			{
+				pthread_mutex_unlock (&fed_mutex);
+				continue;
+			}
+
+			/* A batch the peer only took part of is finished before the next one */
+			if (link->sent == link->spare_len)
+			{
+				batch = link->out;
+				link->out = link->spare;
+				link->spare = batch;
+				link->spare_len = link->out_len;
+				link->sent = 0;
+				link->out_len = 0;
+			}
+
+			/* Never waits, so one slow peer cannot hold up the other links. The reader closes the socket, shutting it down wakes it */
+			if (link->sent < link->spare_len)
+			{
+				n = send (link->fd, link->spare + link->sent, link->spare_len - link->sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+				if (n > 0)
+					link->sent += n;
+				else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				{
+					link->dead = 1;
+					shutdown (link->fd, SHUT_RDWR);
+				}
+			}
+
+			pthread_mutex_unlock (&fed_mutex);
+		}
+
+		pthread_mutex_lock (&fed_mutex);
+
+		for (x = 0; x < MAX_FED_NODES; x++)
+		{
+			if (fed_nodes[x].id && now - fed_nodes[x].seen > FED_EXPIRE)
+				fed_nodes[x].id = 0;
+		}
+
+		pthread_mutex_unlock (&fed_mutex);
+	}
+
+	return NULL;
+}
+
+/* Parse host:port */
+int fed_parse_addr (const char *s, struct sockaddr_in *addr)
+{
+	char host[64];
+	const char *colon = strrchr (s, ':');
+
+	if (!colon || colon - s >= sizeof (host))
+		return -1;
+
+	memcpy (host, s, colon - s);
+	host[colon - s] = '\0';
+	memset (addr, 0, sizeof (*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_port = htons (atoi (colon + 1));
+	return inet_pton (AF_INET, host, &addr->sin_addr) == 1 ? 0 : -1;
+}
+
+/* Start federation, listening on addr if it is not NULL and linking to the given peers */
+int fed_init (struct sockaddr_in *addr, struct sockaddr_in *peers, int peer_count)
+{
+	pthread_t tid;
+	int i, one = 1;
+
+	fed_node = ((uint32_t)getpid () * 2654435761u) ^ (uint32_t)time (NULL);
+
+	for (i = 0; i < MAX_PEERS; i++)
+	{
+		fed_links[i].fd = -1;
+		fed_links[i].out = malloc (FED_LINK_BUFFER);
+		fed_links[i].spare = malloc (FED_LINK_BUFFER);
+	}
+
+	if (addr)
+	{
+		fed_listen_fd = socket (AF_INET, SOCK_STREAM, 0);
+		setsockopt (fed_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+
+		if (bind (fed_listen_fd, (struct sockaddr *)addr, sizeof (*addr)) < 0 || listen (fed_listen_fd, 10) < 0)
+			return -1;
+
+		pthread_create (&tid, NULL, &fed_acceptor, NULL);
+		pthread_detach (tid);
+	}
+
+	for (i = 0; i < peer_count; i++)
+	{
+		pthread_create (&tid, NULL, &fed_connector, &peers[i]);
+		pthread_detach (tid);
+	}
+
+	pthread_create (&tid, NULL, &fed_flusher, NULL);
+	pthread_detach (tid);
+	return 0;
+}
+
+/* Check if a process is known to have exited, a dead process can no longer write a slot */
+static int shm_gone (uint32_t pid)
+{
+	return pid && kill (pid, 0) < 0 && errno == ESRCH;
+}
+
+/* Check if a process slot belongs to a running server */
+int shm_alive (shm_proc_t *proc)
+{
+	uint32_t pid = atomic_load (&proc->pid);
+	return pid && time (NULL) - (time_t)atomic_load (&proc->heartbeat) <= SHM_HEARTBEAT_TIMEOUT;
+}
+
+/* Start a seqlock write, only the owning process writes its rows */
+static void shm_write_begin (_Atomic uint32_t *seq)
+{
+	atomic_fetch_add_explicit (seq, 1, memory_order_relaxed);
+	atomic_thread_fence (memory_order_release);
+}
+
+/* Finish a seqlock write */
+static void shm_write_end (_Atomic uint32_t *seq)
+{
+	atomic_fetch_add_explicit (seq, 1, memory_order_release);
+}
+
+/* Copy a row written by another process, retrying while it changes.
+   Returns -1 if the row stays torn, its writer may have died mid write */
+static int shm_read (shm_proc_t *proc, _Atomic uint32_t *seq, void *dst, const void *src, size_t len)
+{
+	uint32_t before;
+	int spins = 0;
+
+	do
+	{
+		while ((before = atomic_load_explicit (seq, memory_order_acquire)) & 1)
+		{
+			if (++spins > SHM_READ_SPINS || !shm_alive (proc))
+				return -1;
+		}
+
+		memcpy (dst, src, len);
+		atomic_thread_fence (memory_order_acquire);
+	}
+	while (atomic_load_explicit (seq, memory_order_relaxed) != before && ++spins <= SHM_READ_SPINS);
+
+	return spins > SHM_READ_SPINS ? -1 : 0;
+}
+
+/* Publish the state of a local client to the other processes */
+void shm_publish (client_t *cli)
+{
+	shm_entry_t *e;
+
+	if (!shm_self)
+		return;
+
+	e = &shm_self->entries[cli->uid];
+	shm_write_begin (&e->seq);
+	e->used = 1;
+	memcpy (e->name, cli->name, sizeof (e->name));
+	memcpy (e->room, cli->room, sizeof (e->room));
+	memcpy (e->status, cli->status, sizeof (e->status));
+	shm_write_end (&e->seq);
+}
+
+/* Withdraw a local client */
+void shm_withdraw (int uid)
+{
+	shm_entry_t *e;
+
+	if (!shm_self)
+		return;
+
+	e = &shm_self->entries[uid];
+	shm_write_begin (&e->seq);
+	e->used = 0;
+	shm_write_end (&e->seq);
+}
+
+/* Mirror the member count of a local room. Call with rooms_mutex held */
+void shm_room_update (room_t *r)
+{
+	shm_room_t *sr;
+
+	if (!shm_self)
+		return;
+
+	sr = &shm_self->rooms[r - rooms];
+	shm_write_begin (&sr->seq);
+	memcpy (sr->name, r->name, sizeof (sr->name));
+	sr->members = r->members;
+	shm_write_end (&sr->seq);
+}
+
+/* Queue a message on the ring of a process, returns -1 if the ring is full */
+int shm_push (shm_proc_t *proc, int type, const char *to, const char *name, const char *s)
+{
+	shm_ring_t *ring = &proc->ring;
+	shm_slot_t *slot;
+	uint32_t pos, seq, owner, pid = getpid ();
+	size_t len;
+
+	pos = atomic_load_explicit (&ring->head, memory_order_relaxed);
+
+	/* Bounded multi producer ring, a slot is ours once head moved past it. The slot names its producer
+	   before head moves, so a slot left unpublished always tells whose death it waits for */
+	while (1)
+	{
+		slot = &ring->slots[pos & (SHM_RING_SLOTS - 1)];
+		seq = atomic_load_explicit (&slot->seq, memory_order_acquire);
+
+		if (seq == pos)
+		{
+			owner = 0;
+
+			if (atomic_compare_exchange_strong (&slot->producer, &owner, pid))
+			{
+				if (atomic_compare_exchange_strong (&ring->head, &pos, pos + 1))
+					break;
+
+				atomic_store (&slot->producer, 0);
+			}
+			else if (shm_gone (owner))
+			{
+				/* Died between naming itself and moving head */
+				atomic_compare_exchange_strong (&slot->producer, &owner, 0);
+			}
+
+			pos = atomic_load_explicit (&ring->head, memory_order_relaxed);
+		}
+		else if ((int32_t)(seq - pos) < 0)
+		{
+			return -1;
+		}
+		else
+		{
+			pos = atomic_load_explicit (&ring->head, memory_order_relaxed);
+		}
+	}
+
+	len = strlen (s);
+
+	if (len > MAX_HISTORY_MESSAGE_LENGTH)
+		len = MAX_HISTORY_MESSAGE_LENGTH;
+
+	slot->type = type;
+	strncpy (slot->to, to, MAX_NAME_LENGTH);
+	slot->to[MAX_NAME_LENGTH] = '\0';
+	strncpy (slot->name, name, MAX_NAME_LENGTH);
+	slot->name[MAX_NAME_LENGTH] = '\0';
+	slot->len = len;
+	memcpy (slot->text, s, len);
+	atomic_store_explicit (&slot->seq, pos + 1, memory_order_release);
+
+	/* Only pay for a wake up if the consumer went to sleep */
+	if (atomic_load (&ring->sleeping))
+	{
+		atomic_fetch_add (&ring->futex, 1);
+		syscall (SYS_futex, &ring->futex, FUTEX_WAKE, 1, NULL, NULL, 0);
+	}
+
+	return 0;
+}
+
+/* Deliver a room broadcast to the other processes having members in the room */
+void shm_room (const char *s, const char *room, const char *name)
+{
+	shm_room_t copy;
+	int p, i;
+
+	if (!shm_self)
+		return;
+
+	for (p = 0; p < SHM_MAX_PROCS; p++)
+	{
+		shm_proc_t *proc = &shm_seg->procs[p];
+
+		if (proc == shm_self || !shm_alive (proc))
+			continue;
+
+		for (i = 0; i < MAX_ROOMS; i++)
+		{
+			if (!atomic_load_explicit (&proc->rooms[i].members, memory_order_relaxed))
+				continue;
+
+			if (shm_read (proc, &proc->rooms[i].seq, &copy, &proc->rooms[i], sizeof (copy)) < 0)
+				continue;
+
+			if (copy.members && !strcicmp (copy.name, room))
+			{
+				if (shm_push (proc, SHM_ROOM, room, name, s) < 0)
+					atomic_fetch_add_explicit (&shm_dropped, 1, memory_order_relaxed);
+
+				break;
+			}
+		}
+	}
+}
+
+/* Find the process holding a client name, NULL if none */
+shm_proc_t *shm_find (const char *nick)
+{
+	shm_entry_t copy;
+	int p, i;
+
+	if (!shm_self)
+		return NULL;
+
+	for (p = 0; p < SHM_MAX_PROCS; p++)
+	{
+		shm_proc_t *proc = &shm_seg->procs[p];
+
+		if (proc == shm_self || !shm_alive (proc))
+			continue;
+
+		for (i = 0; i < MAX_CLIENTS; i++)
+		{
+			if (shm_read (proc, &proc->entries[i].seq, &copy, &proc->entries[i], sizeof (copy)) < 0)
+				continue;
+
+			if (copy.used && !strcicmp (copy.name, nick))
+				return proc;
+		}
+	}
+
+	return NULL;
+}
+
+/* Send to a client of another process, returns -1 if no process has that name */
+int shm_direct (const char *s, const char *nick, const char *name)
+{
+	shm_proc_t *proc = shm_find (nick);
+
+	if (!proc)
+		return -1;
+
+	if (shm_push (proc, SHM_DIRECT, nick, name, s) < 0)
+		atomic_fetch_add_explicit (&shm_dropped, 1, memory_order_relaxed);
+
+	return 0;
+}
+
+/* Number of clients of the other processes */
+int shm_count (void)
+{
+	int p, i, count = 0;
+
+	if (!shm_self)
+		return 0;
+
+	for (p = 0; p < SHM_MAX_PROCS; p++)
+	{
+		shm_proc_t *proc = &shm_seg->procs[p];
+
+		if (proc == shm_self || !shm_alive (proc))
+			continue;
+
+		for (i = 0; i < MAX_CLIENTS; i++)
+		{
+			if (atomic_load_explicit (&proc->entries[i].used, memory_order_relaxed))
+				count++;
+		}
+	}
+
+	return count;
+}
+
+/* Send list of the clients of the other processes */
+void shm_send_clients (client_t *cli)
+{
+	char s[MAX_SHORT_MESSAGE_LENGTH + 2 * MAX_NAME_LENGTH + 64];
+	shm_entry_t copy;
+	int p, i;
+
+	if (!shm_self)
+		return;
+
+	for (p = 0; p < SHM_MAX_PROCS; p++)
+	{
+		shm_proc_t *proc = &shm_seg->procs[p];
+
+		if (proc == shm_self || !shm_alive (proc))
+			continue;
+
+		for (i = 0; i < MAX_CLIENTS; i++)
+		{
+			if (shm_read (proc, &proc->entries[i].seq, &copy, &proc->entries[i], sizeof (copy)) < 0)
+				continue;
+
+			if (copy.used)
+			{
+				sprintf (s, "  %s<%s>[%s] %s\x1B[37m\r\n", colors[i % 4], copy.room, copy.name, copy.status);
+				send_message_self (s, cli);
+			}
+		}
+	}
+}
+
+/* Drain the ring of this process */
+void *shm_consumer (void *arg)
+{
+	shm_ring_t *ring = &shm_self->ring;
+	struct timespec timeout = {1, 0};
+	shm_slot_t *slot;
+	uint32_t pos, wake;
+	char to[MAX_NAME_LENGTH + 1];
+	char name[MAX_NAME_LENGTH + 1];
+	char text[MAX_HISTORY_MESSAGE_LENGTH + 1];
+	int type, uid;
+
+	while (1)
+	{
+		atomic_store (&shm_self->heartbeat, (uint32_t)time (NULL));
+		pos = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+		slot = &ring->slots[pos & (SHM_RING_SLOTS - 1)];
+
+		if (atomic_load_explicit (&slot->seq, memory_order_acquire) != pos + 1 && atomic_load (&ring->head) != pos)
+		{
+			/* Claimed but not published, skip it only once its producer has exited and cannot publish late */
+			if (shm_gone (atomic_load (&slot->producer)))
+			{
+				atomic_store (&slot->producer, 0);
+				atomic_store_explicit (&slot->seq, pos + SHM_RING_SLOTS, memory_order_release);
+				atomic_store_explicit (&ring->tail, pos + 1, memory_order_relaxed);
+				continue;
+			}
+		}
+
+		if (atomic_load_explicit (&slot->seq, memory_order_acquire) != pos + 1)
+		{
+			/* Empty, announce we sleep and check again before waiting */
+			wake = atomic_load (&ring->futex);
+			atomic_store (&ring->sleeping, 1);
+
+			if (atomic_load_explicit (&slot->seq, memory_order_acquire) != pos + 1)
+				syscall (SYS_futex, &ring->futex, FUTEX_WAIT, wake, &timeout, NULL, 0);
+
+			atomic_store (&ring->sleeping, 0);
+			continue;
+		}
+
+		/* Copy out and free the slot before the slow part */
+		type = slot->type;
+		memcpy (to, slot->to, sizeof (to));
+		memcpy (name, slot->name, sizeof (name));
+		memcpy (text, slot->text, slot->len);
+		text[slot->len] = '\0';
+		atomic_store (&slot->producer, 0);
+		atomic_store_explicit (&slot->seq, pos + SHM_RING_SLOTS, memory_order_release);
+		atomic_store_explicit (&ring->tail, pos + 1, memory_order_relaxed);
+
+		if (type == SHM_ROOM)
+			room_fanout (text, to, name, -1);
+		else if ((uid = client_find (to)) != -1)
+			send_message_client (text, name, uid);
+	}
+
+	return NULL;
+}
+
+/* Attach to the shared registry and claim a process slot */
+int shm_init (const char *path)
+{
+	shm_ring_t *ring;
+	pthread_t tid;
+	uint32_t pid;
+	int fd, p, i;
+
+	fd = shm_open (path, O_RDWR | O_CREAT, 0600);
+
+	if (fd < 0 || ftruncate (fd, sizeof (shm_segment_t)) < 0)
+		return -1;
+
+	shm_seg = mmap (NULL, sizeof (shm_segment_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (shm_seg == MAP_FAILED)
+		return -1;
+
+	/* Take a free slot or one left behind by a dead process */
+	for (p = 0; p < SHM_MAX_PROCS && !shm_self; p++)
+	{
+		pid = atomic_load (&shm_seg->procs[p].pid);
+
+		if (pid && !shm_alive (&shm_seg->procs[p]) && kill (pid, 0) < 0 && errno == ESRCH)
+			atomic_compare_exchange_strong (&shm_seg->procs[p].pid, &pid, 0);
+
+		pid = 0;
+
+		if (atomic_compare_exchange_strong (&shm_seg->procs[p].pid, &pid, (uint32_t)getpid ()))
+			shm_self = &shm_seg->procs[p];
+	}
+
+	if (!shm_self)
+	{
+		errno = ENOSPC;
+		return -1;
+	}
+
+	/* A dead owner may have left a seqlock odd */
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		atomic_store (&shm_self->entries[i].used, 0);
+		atomic_store (&shm_self->entries[i].seq, 0);
+	}
+
+	for (i = 0; i < MAX_ROOMS; i++)
+	{
+		atomic_store (&shm_self->rooms[i].members, 0);
+		atomic_store (&shm_self->rooms[i].seq, 0);
+	}
+
+	ring = &shm_self->ring;
+	atomic_store (&ring->head, 0);
+	atomic_store (&ring->tail, 0);
+
+	for (i = 0; i < SHM_RING_SLOTS; i++)
+	{
+		atomic_store (&ring->slots[i].producer, 0);
+		atomic_store (&ring->slots[i].seq, i);
+	}
+
+	atomic_store (&shm_self->heartbeat, (uint32_t)time (NULL));
+	pthread_create (&tid, NULL, &shm_consumer, NULL);
+	pthread_detach (tid);
+	return 0;
+}
+
+/* Send message to all clients in the same room */
+void send_message_all (char *s, char *room, char *name)
+{
+	unsigned long t = trace_begin ();
+
+	room_fanout (s, room, name, -1);
+	shm_room (s, room, name);
+	fed_room (s, room, name);
+	trace_end ("send_message_all", t);
+}
+
+/* Send message to all clients in the same room except yourself */
+void send_message_except_self (char *s, char *room, char *name, int uid)
+{
+	unsigned long t = trace_begin ();
+
+	room_fanout (s, room, name, uid);
+	shm_room (s, room, name);
+	fed_room (s, room, name);
+	trace_end ("send_message_except_self", t);
+}
+
+/* Publish a change of name, room or status */
+void client_changed (client_t *cli)
+{
+	cli->prefix_len = sprintf (cli->prefix, "%s<%s>[%s]\x1B[37m ", colors[cli->uid % 4], cli->room, cli->name);
+	roster_touch (cli->rm);
+	shm_publish (cli);
+}
+
+void roster_put (roster_t *r)
+{
+	if (r && atomic_fetch_sub_explicit (&r->refs, 1, memory_order_acq_rel) == 1)
+		free (r);
+}
+
+int roster_compare (const void *a, const void *b)
+{
+	return strcmp (((const roster_entry_t *)a)->key, ((const roster_entry_t *)b)->key);
+}
+
+/* Render the clients of a room, or every client if room is NULL, sorted by name */
+roster_t *roster_build (const char *room, unsigned long gen)
+{
+	roster_t *r = malloc (sizeof (roster_t) + MAX_CLIENTS * ROSTER_LINE_LENGTH);
+	roster_entry_t *e;
+	client_t *c;
+	int i, x;
+
+	if (!r)
+		return NULL;
+
+	atomic_init (&r->refs, 1);
+	r->gen = gen;
+	r->len = 0;
+	r->count = 0;
+	snprintf (r->room, sizeof (r->room), "%s", room ? room : "");
+	pthread_mutex_lock (&clients_mutex);
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		if (clients[i] && (!room || !strcicmp (clients[i]->room, room)))
+		{
+			e = &r->entries[r->count++];
+			e->uid = i;
+
+			for (x = 0; clients[i]->name[x]; x++)
+				e->key[x] = tolower (clients[i]->name[x]);
+
+			e->key[x] = '\0';
+		}
+	}
+
+	qsort (r->entries, r->count, sizeof (roster_entry_t), roster_compare);
+
+	for (i = 0; i < r->count; i++)
+	{
+		e = &r->entries[i];
+		c = clients[e->uid];
+		e->off = r->len;
+
+		if (!room)
+			r->len += sprintf (r->text + r->len, "  %s<%s>[%s] %s\x1B[37m\r\n", colors[c->uid % 4], c->room, c->name, c->status);
+		else
+			r->len += sprintf (r->text + r->len, "  %s[%s] %s\x1B[37m\r\n", colors[c->uid % 4], c->name, c->status);
+	}
+
+	pthread_mutex_unlock (&clients_mutex);
+	return r;
+}
+
+/* First entry whose name does not sort before prefix, or past the ones starting with it if after is set */
+int roster_search (const roster_t *r, const char *prefix, int after)
+{
+	size_t len = strlen (prefix);
+	int lo = 0, hi = r->count, mid, d;
+
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		d = strncmp (r->entries[mid].key, prefix, len);
+
+		if (d < 0 || (after && !d))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* Get a roster, rebuilding the cached one only if a client listed in it changed since. Release with roster_put, NULL if out of memory */
+roster_t *roster_get (const char *room, room_t *rm)
+{
+	unsigned long gen = atomic_load_explicit (room && rm ? &rm->roster_gen : &roster_gen, memory_order_relaxed);
+	roster_t **cache, *r;
+
+	/* Rooms outside the room table are not cached */
+	if (room && !rm)
+		return roster_build (room, gen);
+
+	cache = room ? &roster_rooms[rm - rooms] : &roster_all;
+	pthread_mutex_lock (&roster_mutex);
+	r = *cache;
+
+	if (!r || r->gen != gen || strcicmp (r->room, room ? room : ""))
+	{
+		roster_put (r);
+		r = *cache = roster_build (room, gen);
+	}
+
+	if (r)
+		atomic_fetch_add_explicit (&r->refs, 1, memory_order_relaxed);
+
+	pthread_mutex_unlock (&roster_mutex);
+	return r;
+}
+
+/* Send list of active clients in one write */
+void send_active_clients (client_t *cli)
+{
+	roster_t *r = roster_get (NULL, NULL);
+
+	if (!r)
+		return;
+
+	client_write (cli, r->text, r->len);
+	roster_put (r);
+}
+
+/* Send a page of the clients whose name starts with prefix, "*" matches everyone */
+void send_clients_page (client_t *cli, const char *prefix, int page)
+{
+	char key[MAX_NAME_LENGTH + 1];
+	char buff_out[MAX_NAME_LENGTH + 96];
+	roster_t *r = roster_get (NULL, NULL);
+	int i, first, last, pages;
+
+	if (!r)
+		return;
+
+	if (!strcmp (prefix, "*"))
+		prefix = "";
+
+	for (i = 0; prefix[i] && i < MAX_NAME_LENGTH; i++)
+		key[i] = tolower (prefix[i]);
+
+	key[i] = '\0';
+
+	/* Names starting with the prefix are next to each other in the sorted roster */
+	first = roster_search (r, key, 0);
+	last = roster_search (r, key, 1);
+	pages = (last - first + WHO_PAGE_SIZE - 1) / WHO_PAGE_SIZE;
+
+	if (!pages)
+	{
+		sprintf (buff_out, "\r\n\x1B[33mNO MATCH\x1B[37m [%s*]\r\n", key);
+		send_message_self (buff_out, cli);
+		roster_put (r);
+		return;
+	}
+
+	/* Clamp before multiplying, the page comes straight from the user */
+	if (page < 1)
+		page = 1;
+	else if (page > pages)
+		page = pages;
+
+	sprintf (buff_out, "\r\n\x1B[33mCLIENTS\x1B[37m %d MATCHING [%s*] | \x1B[33mPAGE\x1B[37m %d/%d\r\n", last - first, key, page, pages);
+	send_message_self (buff_out, cli);
+	first += (page - 1) * WHO_PAGE_SIZE;
+
+	if (first < last)
+	{
+		if (last > first + WHO_PAGE_SIZE)
+			last = first + WHO_PAGE_SIZE;
+
+		client_write (cli, r->text + r->entries[first].off, (last < r->count ? r->entries[last].off : r->len) - r->entries[first].off);
+	}
+
+	roster_put (r);
+}
+
+/* Send list of active clients in a room in one write */
+void send_active_clients_room (client_t *cli, char *room)
+{
+	roster_t *r = roster_get (room, !strcicmp (room, cli->room) ? cli->rm : NULL);
+
+	if (!r)
+		return;
+
+	client_write (cli, r->text, r->len);
+	roster_put (r);
+}
+
+#define ROOM_SPARE_COST(r) ((r)->name[0] ? (r)->count + 1 : 0)
+
+/* Give every history slot to the free pool */
+void history_init (void)
+{
+	for (history_free_count = 0; history_free_count < HISTORY_POOL_SIZE; history_free_count++)
+		history_free[history_free_count] = history_free_count;
+}
+
+/* Find a room by name, create it if asked. Call with rooms_mutex held */
+static room_t *room_find (const char *name, int create)
+{
+	room_t *spare = NULL;
+	int i;
+
+	for (i = 0; i < MAX_ROOMS; i++)
+	{
+		if (rooms[i].name[0] && !strcicmp (rooms[i].name, name))
+			return &rooms[i];
+
+		/* Prefer an unused entry, then the empty room with the least history */
+		if (!rooms[i].members && (!spare || ROOM_SPARE_COST (&rooms[i]) < ROOM_SPARE_COST (spare)))
+			spare = &rooms[i];
+	}
+
+	if (!create || !spare)
+		return NULL;
+
+	/* Recycle the entry, giving its history back to the pool */
+	while (spare->count)
+	{
+		history_free[history_free_count++] = spare->history[spare->head];
+		spare->head = (spare->head + 1) % ROOM_HISTORY_LENGTH;
+		spare->count--;
+	}
+
+	strcpy (spare->name, name);
+	spare->head = 0;
+	atomic_store_explicit (&spare->msgs, 0, memory_order_relaxed);
+	atomic_store_explicit (&spare->bytes, 0, memory_order_relaxed);
+	atomic_store_explicit (&spare->window, 0, memory_order_relaxed);
+	atomic_store_explicit (&spare->window_msgs, 0, memory_order_relaxed);
+	atomic_store_explicit (&spare->window_bytes, 0, memory_order_relaxed);
+	atomic_store_explicit (&spare->last_msgs, 0, memory_order_relaxed);
+	atomic_store_explicit (&spare->last_bytes, 0, memory_order_relaxed);
+	atomic_store_explicit (&spare->peak_fanout, 0, memory_order_relaxed);
+	return spare;
+}
+
+/* Look up or create a room without joining it */
+room_t *room_get (const char *name)
+{
+	room_t *r;
+	pthread_mutex_lock (&rooms_mutex);
+	r = room_find (name, 1);
+	pthread_mutex_unlock (&rooms_mutex);
+	return r;
+}
+
+/* Enter a room, returns NULL if the room table is full */
+room_t *room_join (const char *name)
+{
+	room_t *r;
+	pthread_mutex_lock (&rooms_mutex);
+	r = room_find (name, 1);
+
+	if (r)
+	{
+		r->members++;
+		roster_touch (r);
+		shm_room_update (r);
+	}
+
+	pthread_mutex_unlock (&rooms_mutex);
+	fed_changed ();
+	return r;
+}
+
+/* Leave a room, its history is kept until the entry is recycled */
+void room_leave (room_t *r)
+{
+	if (!r)
+		return;
+
+	pthread_mutex_lock (&rooms_mutex);
+	r->members--;
+	roster_touch (r);
+	shm_room_update (r);
+	pthread_mutex_unlock (&rooms_mutex);
+	fed_changed ();
+}
+
+/* Append a rendered message to the room history */
+void history_add (room_t *r, const char *s, const char *name)
+{
+	history_slot_t *slot;
+	int i, idx;
+
+	if (!r)
+		return;
+
+	pthread_mutex_lock (&rooms_mutex);
+
+	if (r->count == ROOM_HISTORY_LENGTH)
+	{
+		/* Ring is full, overwrite our oldest message */
+		idx = r->history[r->head];
+		r->head = (r->head + 1) % ROOM_HISTORY_LENGTH;
+		r->count--;
+	}
+	else if (history_free_count)
+	{
+		idx = history_free[--history_free_count];
+	}
+	else
+	{
+		/* Pool exhausted, take the oldest message of the room holding the most */
+		room_t *victim = r;
+
+		for (i = 0; i < MAX_ROOMS; i++)
+		{
+			if (rooms[i].count > victim->count)
+				victim = &rooms[i];
+		}
+
+		if (!victim->count)
+		{
+			pthread_mutex_unlock (&rooms_mutex);
+			return;
+		}
+
+		idx = victim->history[victim->head];
+		victim->head = (victim->head + 1) % ROOM_HISTORY_LENGTH;
+		victim->count--;
+	}
+
+	slot = &history_pool[idx];
+	slot->len = strlen (s);
+
+	if (slot->len > MAX_HISTORY_MESSAGE_LENGTH)
+		slot->len = MAX_HISTORY_MESSAGE_LENGTH;
+
+	memcpy (slot->text, s, slot->len);
+	strncpy (slot->name, name, MAX_NAME_LENGTH);
+	slot->name[MAX_NAME_LENGTH] = '\0';
+	r->history[(r->head + r->count) % ROOM_HISTORY_LENGTH] = idx;
+	r->count++;
+	pthread_mutex_unlock (&rooms_mutex);
+}
+
+/* Replay up to n of the latest room messages, returns the number sent */
+int send_history (room_t *r, int n, client_t *cli)
+{
+	char cmpname[MAX_NAME_LENGTH + 3];
+	char *buff, *p;
+	int i, sent = 0;
+
+	if (!r)
+		return 0;
+
+	/* Copy out under the lock, a slow reader must not stall the room */
+	buff = malloc (ROOM_HISTORY_LENGTH * MAX_HISTORY_MESSAGE_LENGTH + 128);
+	p = buff + sprintf (buff, "\r\n\x1B[33mHISTORY\x1B[37m <%s>\r\n", cli->room);
+	pthread_mutex_lock (&rooms_mutex);
+
+	if (n > r->count)
+		n = r->count;
+
+	for (i = r->count - n; i < r->count; i++)
+	{
+		history_slot_t *slot = &history_pool[r->history[(r->head + i) % ROOM_HISTORY_LENGTH]];
+		strcpy (cmpname, "|");
+		strcat (cmpname, slot->name);
+		strcat (cmpname, "|");
+
+		if (strcicmp (cli->mute, cmpname))
+		{
+			memcpy (p, slot->text, slot->len);
+			p += slot->len;
+			sent++;
+		}
+	}
+
+	pthread_mutex_unlock (&rooms_mutex);
+	strcpy (p, "\r\n");
+
+	if (sent)
+		send_message_self (buff, cli);
+
+	free (buff);
+	return sent;
+}
+
+/* Open a log segment for appending */
+int log_open_segment (unsigned int seq)
+{
+	char path[PATH_MAX + 32];
+	snprintf (path, sizeof (path), "%s/room-%08u.log", log_dir, seq);
+	return open (path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+}
+
+/* Remove a log segment that fell out of the retention window */
+void log_remove_segment (unsigned int seq)
+{
+	char path[PATH_MAX + 32];
+	snprintf (path, sizeof (path), "%s/room-%08u.log", log_dir, seq);
+	unlink (path);
+}
+
+/* Rebuild room history from one segment, records are walked in place.
+ * Returns the bytes of whole records, (size_t)-1 if the segment could not be read */
+size_t log_replay_segment (unsigned int seq)
+{
+	char path[PATH_MAX + 32];
+	char room[MAX_NAME_LENGTH + 1];
+	char name[MAX_NAME_LENGTH + 1];
+	char text[MAX_HISTORY_MESSAGE_LENGTH + 1];
+	struct stat st;
+	log_record_t rec;
+	const char *map, *p, *end;
+	int fd;
+
+	snprintf (path, sizeof (path), "%s/room-%08u.log", log_dir, seq);
+	fd = open (path, O_RDONLY);
+
+	if (fd < 0)
+		return (size_t)-1;
+
+	if (fstat (fd, &st) < 0)
+	{
+		close (fd);
+		return (size_t)-1;
+	}
+
+	/* Too short for a record, all of it is a torn tail */
+	if (st.st_size < sizeof (log_record_t))
+	{
+		close (fd);
+		return 0;
+	}
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+
+	if (map == MAP_FAILED)
+		return (size_t)-1;
+
+	madvise ((void *)map, st.st_size, MADV_SEQUENTIAL);
+	end = map + st.st_size;
+
+	for (p = map; end - p >= sizeof (log_record_t); p += rec.len)
+	{
+		memcpy (&rec, p, sizeof (rec));
+
+		/* Stop at a torn tail left by a crash */
+		if (rec.len != sizeof (rec) + rec.room_len + rec.name_len + rec.text_len || rec.len > end - p
+				|| rec.room_len > MAX_NAME_LENGTH || rec.name_len > MAX_NAME_LENGTH || rec.text_len > MAX_HISTORY_MESSAGE_LENGTH)
+			break;
+
+		memcpy (room, p + sizeof (rec), rec.room_len);
+		room[rec.room_len] = '\0';
+		memcpy (name, p + sizeof (rec) + rec.room_len, rec.name_len);
+		name[rec.name_len] = '\0';
+		memcpy (text, p + sizeof (rec) + rec.room_len + rec.name_len, rec.text_len);
+		text[rec.text_len] = '\0';
+		history_add (room_get (room), text, name);
+	}
+
+	munmap ((void *)map, st.st_size);
+	return p - map;
+}
+
+/* Background writer, batches queued records into one write per wakeup */
+void *log_writer (void *arg)
+{
+	struct timespec deadline;
+	time_t last_sync = time (NULL);
+	int dirty = 0;
+	char *batch;
+	size_t len;
+
+	while (1)
+	{
+		pthread_mutex_lock (&log_mutex);
+
+		if (!log_len)
+		{
+			clock_gettime (CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += LOG_SYNC_INTERVAL;
+			pthread_cond_timedwait (&log_cond, &log_mutex, &deadline);
+		}
+
+		pthread_mutex_unlock (&log_mutex);
+		pthread_mutex_lock (&log_write_mutex);
+		pthread_mutex_lock (&log_mutex);
+		/* Swap buffers so producers keep appending while we write */
+		batch = log_buf;
+		len = log_len;
+		log_buf = log_spare;
+		log_spare = batch;
+		log_len = 0;
+		pthread_cond_broadcast (&log_space);
+		pthread_mutex_unlock (&log_mutex);
+
+		if (len)
+		{
+			if (write (log_fd, batch, len) != len)
+				perror ("\x1B[34mRoom log write failed\x1B[37m");
+
+			log_segment_size += len;
+			dirty = 1;
+		}
+
+		/* Durability is paid here, never on the message path */
+		if (dirty && time (NULL) - last_sync >= LOG_SYNC_INTERVAL)
+		{
+			fdatasync (log_fd);
+			last_sync = time (NULL);
+			dirty = 0;
+		}
+
+		if (log_segment_size >= LOG_SEGMENT_SIZE)
+		{
+			fdatasync (log_fd);
+			close (log_fd);
+			log_fd = log_open_segment (++log_seq);
+			log_segment_size = 0;
+			dirty = 0;
+
+			if (log_seq >= LOG_SEGMENTS_KEEP)
+				log_remove_segment (log_seq - LOG_SEGMENTS_KEEP);
+		}
+
+		pthread_mutex_unlock (&log_write_mutex);
+	}
+
+	return NULL;
+}
+
+/* Write out and sync everything queued, the writer thread is held off meanwhile */
+void log_flush (void)
+{
+	if (log_fd < 0)
+		return;
+
+	pthread_mutex_lock (&log_write_mutex);
+	pthread_mutex_lock (&log_mutex);
+
+	if (log_len && write (log_fd, log_buf, log_len) != log_len)
+		perror ("\x1B[34mRoom log write failed\x1B[37m");
+
+	log_segment_size += log_len;
+	log_len = 0;
+	pthread_cond_broadcast (&log_space);
+	pthread_mutex_unlock (&log_mutex);
+	fdatasync (log_fd);
+	pthread_mutex_unlock (&log_write_mutex);
+}
+
+/* Replay the kept segments and start appending to a fresh one */
+int log_init (const char *dir)
+{
+	unsigned int seq, first = UINT_MAX, last = 0;
+	char path[PATH_MAX + 32];
+	struct dirent *de;
+	size_t valid = 0;
+	pthread_t tid;
+	DIR *d;
+
+	strncpy (log_dir, dir, sizeof (log_dir) - 1);
+	mkdir (log_dir, 0755);
+	d = opendir (log_dir);
+
+	if (!d)
+		return -1;
+
+	while ((de = readdir (d)))
+	{
+		if (sscanf (de->d_name, "room-%08u.log", &seq) == 1)
+		{
+			if (seq < first)
+				first = seq;
+
+			if (seq > last)
+				last = seq;
+		}
+	}
+
+	closedir (d);
+
+	if (first != UINT_MAX)
+	{
+		/* Drop what rotation would have removed already */
+		for (; last - first >= LOG_SEGMENTS_KEEP; first++)
+			log_remove_segment (first);
+
+		for (seq = first; seq <= last; seq++)
+			valid = log_replay_segment (seq);
+
+		/* Keep filling the last segment so restarts do not rotate history away, a torn tail is cut off first.
+		   One that could not be read is left alone */
+		if (valid != (size_t)-1 && valid < LOG_SEGMENT_SIZE)
+		{
+			snprintf (path, sizeof (path), "%s/room-%08u.log", log_dir, last);
+
+			if (truncate (path, valid) == 0)
+				log_segment_size = valid;
+			else
+				last++;
+		}
+		else
+		{
+			last++;
+		}
+
+		log_seq = last;
+	}
+
+	log_fd = log_open_segment (log_seq);
+
+	if (log_fd < 0)
+		return -1;
+
+	log_buf = malloc (LOG_BUFFER_SIZE);
+	log_spare = malloc (LOG_BUFFER_SIZE);
+	pthread_create (&tid, NULL, &log_writer, NULL);
+	pthread_detach (tid);
+	return 0;
+}
+
+/* Queue a room message for the log writer */
+void log_append (const char *room, const char *name, const char *s)
+{
+	log_record_t rec;
+
+	if (log_fd < 0)
+		return;
+
+	rec.room_len = strlen (room);
+	rec.name_len = strlen (name);
+	rec.text_len = strlen (s);
+
+	if (rec.text_len > MAX_HISTORY_MESSAGE_LENGTH)
+		rec.text_len = MAX_HISTORY_MESSAGE_LENGTH;
+
+	rec.len = sizeof (rec) + rec.room_len + rec.name_len + rec.text_len;
+	pthread_mutex_lock (&log_mutex);
+
+	/* Only wait if the writer fell a whole buffer behind */
+	while (log_len + rec.len > LOG_BUFFER_SIZE)
+		pthread_cond_wait (&log_space, &log_mutex);
+
+	memcpy (log_buf + log_len, &rec, sizeof (rec));
+	memcpy (log_buf + log_len + sizeof (rec), room, rec.room_len);
+	memcpy (log_buf + log_len + sizeof (rec) + rec.room_len, name, rec.name_len);
+	memcpy (log_buf + log_len + sizeof (rec) + rec.room_len + rec.name_len, s, rec.text_len);
+
+	if (!log_len)
+		pthread_cond_signal (&log_cond);
+
+	log_len += rec.len;
+	pthread_mutex_unlock (&log_mutex);
+}
+
+/* Give an event ring back when its thread exits, the writer still drains it */
+void event_release (void *ring)
+{
+	atomic_store_explicit (&((event_ring_t *)ring)->owner, 0, memory_order_release);
+}
+
+/* Queue an event without locking or I/O, dropped if the ring of the thread is full */
+void event_log (int type, uint32_t addr, int uid, const char *name, const char *room, const char *detail)
+{
+	event_t *e, *events;
+	unsigned long head;
+	int i, expected;
+
+	if (event_fd < 0 || event_full)
+		return;
+
+	if (!event_ring)
+	{
+		int tid = syscall (SYS_gettid);
+
+		for (i = 0; i < EVENT_THREADS && !event_ring; i++)
+		{
+			expected = 0;
+
+			if (atomic_compare_exchange_strong (&event_rings[i].owner, &expected, tid))
+			{
+				/* The writer skips a ring until its events are published */
+				if (!atomic_load_explicit (&event_rings[i].events, memory_order_relaxed))
+				{
+					if (!(events = calloc (EVENT_RING_SIZE, sizeof (event_t))))
+					{
+						atomic_store_explicit (&event_rings[i].owner, 0, memory_order_release);
+						break;
+					}
+
+					atomic_store_explicit (&event_rings[i].events, events, memory_order_release);
+				}
+
+				event_ring = &event_rings[i];
+				pthread_setspecific (event_key, event_ring);
+			}
+		}
+
+		/* Do not search again on every event */
+		if (!event_ring)
+		{
+			event_full = 1;
+			return;
+		}
+	}
+
+	head = atomic_load_explicit (&event_ring->head, memory_order_relaxed);
+
+	if (head - atomic_load_explicit (&event_ring->tail, memory_order_acquire) >= EVENT_RING_SIZE)
+	{
+		atomic_fetch_add_explicit (&event_dropped, 1, memory_order_relaxed);
+		return;
+	}
+
+	events = atomic_load_explicit (&event_ring->events, memory_order_relaxed);
+	e = &events[head & (EVENT_RING_SIZE - 1)];
+	e->type = type;
+	clock_gettime (CLOCK_REALTIME, &e->ts);
+	e->addr = addr;
+	e->uid = uid;
+	snprintf (e->name, sizeof (e->name), "%s", name ? name : "");
+	snprintf (e->room, sizeof (e->room), "%s", room ? room : "");
+	snprintf (e->detail, sizeof (e->detail), "%s", detail ? detail : "");
+	atomic_store_explicit (&event_ring->head, head + 1, memory_order_release);
+}
+
+/* Copy s as a JSON string, returns the end of the output */
+char *event_quote (char *p, const char *s)
+{
+	*p++ = '"';
+
+	for (; *s; s++)
+	{
+		if (*s == '"' || *s == '\\')
+			p += sprintf (p, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			p += sprintf (p, "\\u%04x", (unsigned char)*s);
+		else
+			*p++ = *s;
+	}
+
+	*p++ = '"';
+	return p;
+}
+
+/* Format one event as a JSON line, returns its length */
+int event_format (char *buf, const event_t *e)
+{
+	char *p = buf;
+	char addr[INET_ADDRSTRLEN];
+	struct tm tm;
+
+	gmtime_r (&e->ts.tv_sec, &tm);
+	p += strftime (p, 32, "{\"ts\":\"%Y-%m-%dT%H:%M:%S", &tm);
+	p += sprintf (p, ".%03ldZ\",\"event\":\"%s\"", e->ts.tv_nsec / 1000000, event_names[e->type]);
+
+	if (e->addr)
+	{
+		inet_ntop (AF_INET, &e->addr, addr, sizeof (addr));
+		p += sprintf (p, ",\"addr\":\"%s\"", addr);
+	}
+
+	if (e->uid >= 0)
+		p += sprintf (p, ",\"uid\":%d", e->uid);
+
+	if (*e->name)
+	{
+		p += sprintf (p, ",\"name\":");
+		p = event_quote (p, e->name);
+	}
+
+	if (*e->room)
+	{
+		p += sprintf (p, ",\"room\":");
+		p = event_quote (p, e->room);
+	}
+
+	if (*e->detail)
+	{
+		p += sprintf (p, ",\"%s\":", e->type == EVENT_REJECT ? "reason" : "to");
+		p = event_quote (p, e->detail);
+	}
+
+	p += sprintf (p, "}\n");
+	return p - buf;
+}
+
+/* Write out a batch of formatted events */
+void event_flush (char *buf, size_t *len)
+{
+	if (*len && write (event_fd, buf, *len) != *len)
+		perror ("\x1B[34mEvent log write failed\x1B[37m");
+
+	*len = 0;
+}
+
+/* Drain every ring, batching the records of all threads into few writes */
+void *event_writer (void *arg)
+{
+	char *buf = malloc (EVENT_BATCH_SIZE);
+	event_t *events;
+	unsigned long head, tail, dropped, reported = 0;
+	size_t len = 0;
+	int i;
+
+	while (1)
+	{
+		usleep (EVENT_FLUSH_INTERVAL * 1000);
+
+		for (i = 0; i < EVENT_THREADS; i++)
+		{
+			if (!(events = atomic_load_explicit (&event_rings[i].events, memory_order_acquire)))
+				continue;
+
+			head = atomic_load_explicit (&event_rings[i].head, memory_order_acquire);
+			tail = atomic_load_explicit (&event_rings[i].tail, memory_order_relaxed);
+
+			for (; tail != head; tail++)
+			{
+				if (len + EVENT_MAX_LENGTH > EVENT_BATCH_SIZE)
+					event_flush (buf, &len);
+
+				len += event_format (buf + len, &events[tail & (EVENT_RING_SIZE - 1)]);
+			}
+
+			atomic_store_explicit (&event_rings[i].tail, tail, memory_order_release);
+		}
+
+		dropped = atomic_load_explicit (&event_dropped, memory_order_relaxed);
+
+		if (dropped != reported)
+		{
+			if (len + EVENT_MAX_LENGTH > EVENT_BATCH_SIZE)
+				event_flush (buf, &len);
+
+			len += sprintf (buf + len, "{\"event\":\"dropped\",\"count\":%lu}\n", dropped - reported);
+			reported = dropped;
+		}
+
+		event_flush (buf, &len);
+	}
+
+	return NULL;
+}
+
+/* Open the event log and start its writer */
+int event_init (const char *path)
+{
+	pthread_t tid;
+
+	event_fd = open (path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+	if (event_fd < 0)
+		return -1;
+
+	pthread_key_create (&event_key, event_release);
+	pthread_create (&tid, NULL, &event_writer, NULL);
+	pthread_detach (tid);
+	return 0;
+}
+
+/* Add weight to a key, replacing the smallest counter when the key is not tracked. Call with top_mutex held */
+void top_add (top_summary_t *t, const char *key, unsigned long weight)
+{
+	top_entry_t *e, *min = NULL;
+	int i;
+
+	for (i = 0; i < t->used; i++)
+	{
+		e = &t->entries[i];
+
+		if (!strcmp (e->key, key))
+		{
+			e->count += weight;
+			return;
+		}
+
+		if (!min || e->count < min->count)
+			min = e;
+	}
+
+	if (t->used < TOP_COUNTERS)
+	{
+		e = &t->entries[t->used++];
+		e->count = weight;
+		e->error = 0;
+	}
+	else
+	{
+		e = min;
+		e->error = e->count;
+		e->count += weight;
+	}
+
+	snprintf (e->key, sizeof (e->key), "%s", key);
+}
+
+/* Count a message of a sender in a room */
+void top_count (const char *name, const char *room, size_t len)
+{
+	pthread_mutex_lock (&top_mutex);
+	top_add (&top_summaries[TOP_SENDER_MSGS], name, 1);
+	top_add (&top_summaries[TOP_SENDER_BYTES], name, len);
+	top_add (&top_summaries[TOP_ROOM_MSGS], room, 1);
+	top_add (&top_summaries[TOP_ROOM_BYTES], room, len);
+	pthread_mutex_unlock (&top_mutex);
+}
+
+int top_compare (const void *a, const void *b)
+{
+	const top_entry_t *x = a, *y = b;
+
+	return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+/* Send the heavy hitters of every summary, or clear them */
+void send_top (client_t *cli, int reset)
+{
+	top_entry_t entries[TOP_COUNTERS];
+	char buff_out[MAX_NAME_LENGTH + 96];
+	int i, x, used;
+
+	for (i = 0; i < TOP_SUMMARIES; i++)
+	{
+		pthread_mutex_lock (&top_mutex);
+		used = top_summaries[i].used;
+		memcpy (entries, top_summaries[i].entries, used * sizeof (top_entry_t));
+
+		if (reset)
+			top_summaries[i].used = 0;
+
+		pthread_mutex_unlock (&top_mutex);
+
+		if (reset)
+			continue;
+
+		qsort (entries, used, sizeof (top_entry_t), top_compare);
+		sprintf (buff_out, "\x1B[33m%s\x1B[37m\r\n", top_summaries[i].title);
+		send_message_self (buff_out, cli);
+
+		for (x = 0; x < used && x < TOP_SHOWN; x++)
+		{
+			sprintf (buff_out, "  %-*.*s %lu (+/- %lu)\r\n", MAX_NAME_LENGTH, MAX_NAME_LENGTH, entries[x].key, entries[x].count, entries[x].error);
+			send_message_self (buff_out, cli);
+		}
+	}
+}
+
+/* Count a message sent to a room, the first message of a second keeps the totals of the one before */
+void room_count (room_t *r, size_t len)
+{
+	unsigned long sec, window;
+	int members, peak;
+
+	if (!r)
+		return;
+
+	sec = rate_clock () / 1000;
+	window = atomic_load_explicit (&r->window, memory_order_relaxed);
+	members = r->members;
+	peak = atomic_load_explicit (&r->peak_fanout, memory_order_relaxed);
+
+	if (window != sec && atomic_compare_exchange_strong_explicit (&r->window, &window, sec, memory_order_relaxed, memory_order_relaxed))
+	{
+		unsigned long msgs = atomic_exchange_explicit (&r->window_msgs, 0, memory_order_relaxed);
+		unsigned long bytes = atomic_exchange_explicit (&r->window_bytes, 0, memory_order_relaxed);
+
+		atomic_store_explicit (&r->last_msgs, window + 1 == sec ? msgs : 0, memory_order_relaxed);
+		atomic_store_explicit (&r->last_bytes, window + 1 == sec ? bytes : 0, memory_order_relaxed);
+	}
+
+	atomic_fetch_add_explicit (&r->msgs, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit (&r->bytes, len, memory_order_relaxed);
+	atomic_fetch_add_explicit (&r->window_msgs, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit (&r->window_bytes, len, memory_order_relaxed);
+
+	while (members > peak && !atomic_compare_exchange_weak_explicit (&r->peak_fanout, &peak, members, memory_order_relaxed, memory_order_relaxed))
+		;
+}
+
+/* Send the counters of one room, or of every room in use */
+void send_room_stats (client_t *cli, const char *name)
+{
+	char buff_out[MAX_NAME_LENGTH + 192];
+	unsigned long sec = rate_clock () / 1000;
+	unsigned long window, msgs_rate, bytes_rate;
+	int i, x, members, count, history_bytes, found = 0;
+	room_t *r;
+
+	for (i = 0; i < MAX_ROOMS; i++)
+	{
+		r = &rooms[i];
+
+		/* Names and history only change under the lock, the counters are read as they are */
+		pthread_mutex_lock (&rooms_mutex);
+
+		if (!r->name[0] || (name ? strcicmp (r->name, name) : !r->members))
+		{
+			pthread_mutex_unlock (&rooms_mutex);
+			continue;
+		}
+
+		members = r->members;
+		count = r->count;
+
+		for (x = 0, history_bytes = 0; x < count; x++)
+			history_bytes += history_pool[r->history[(r->head + x) % ROOM_HISTORY_LENGTH]].len;
+
+		sprintf (buff_out, "  %s<%.*s>\x1B[37m members %d", colors[i % 4], MAX_NAME_LENGTH, r->name, members);
+		pthread_mutex_unlock (&rooms_mutex);
+
+		/* Rate of the last whole second */
+		window = atomic_load_explicit (&r->window, memory_order_relaxed);
+		msgs_rate = window + 1 == sec ? atomic_load_explicit (&r->window_msgs, memory_order_relaxed)
+			: window == sec ? atomic_load_explicit (&r->last_msgs, memory_order_relaxed) : 0;
+		bytes_rate = window + 1 == sec ? atomic_load_explicit (&r->window_bytes, memory_order_relaxed)
+			: window == sec ? atomic_load_explicit (&r->last_bytes, memory_order_relaxed) : 0;
+
+		sprintf (buff_out + strlen (buff_out), ", %lu msgs/s, %lu bytes/s, %lu msgs, %lu bytes, peak fanout %d, history %d msgs %d bytes\r\n",
+			msgs_rate, bytes_rate, atomic_load_explicit (&r->msgs, memory_order_relaxed), atomic_load_explicit (&r->bytes, memory_order_relaxed),
+			atomic_load_explicit (&r->peak_fanout, memory_order_relaxed), count, history_bytes);
+		send_message_self (buff_out, cli);
+		found++;
+	}
+
+	if (!found)
+		send_message_self ("  \x1B[33mNO SUCH ROOM\x1B[37m\r\n", cli);
+}
+
+void filter_put (filter_t *f)
+{
+	if (f && atomic_fetch_sub_explicit (&f->refs, 1, memory_order_acq_rel) == 1)
+		free (f);
+}
+
+/* Get the current word filter, NULL if there is none. Release with filter_put */
+filter_t *filter_get (void)
+{
+	unsigned int e = atomic_load_explicit (&filter_epoch, memory_order_relaxed) & 1;
+	filter_t *f;
+
+	/* Announce the load, a reload waits for us before dropping the filter we may see.
+	   The load is ordered after the announce, acquire alone would let it move ahead */
+	atomic_fetch_add (&filter_getting[e], 1);
+	f = atomic_load (&filter_cur);
+
+	if (f)
+		atomic_fetch_add_explicit (&f->refs, 1, memory_order_relaxed);
+
+	atomic_fetch_sub_explicit (&filter_getting[e], 1, memory_order_release);
+	return f;
+}
+
+/* Replace the current word filter, returns the old one once no reader can still take a reference to it */
+filter_t *filter_swap (filter_t *f)
+{
+	filter_t *old = atomic_exchange (&filter_cur, f);
+	unsigned int e;
+	int i;
+
+	/* Drain both counters, flipping first so new readers leave the drained one alone */
+	for (i = 0; i < 2; i++)
+	{
+		e = atomic_fetch_add (&filter_epoch, 1) & 1;
+
+		while (atomic_load_explicit (&filter_getting[e], memory_order_acquire))
+			usleep (100);
+	}
+
+	return old;
+}
+
+/* Compile the patterns of a file, one per line, blank lines and lines starting with # are skipped */
+filter_t *filter_build (const char *path)
+{
+	char line[MAX_SHORT_MESSAGE_LENGTH];
+	char patterns[FILTER_PATTERNS][FILTER_PATTERN_LENGTH + 1];
+	int count = 0, size = 1, i, c, u, v, head, tail, *fail, *queue;
+	filter_node_t *n;
+	filter_t *f;
+	size_t len;
+	FILE *fp;
+
+	if (!(fp = fopen (path, "r")))
+		return NULL;
+
+	while (count < FILTER_PATTERNS && fgets (line, sizeof (line), fp))
+	{
+		len = strcspn (line, "\r\n");
+
+		if (!len || line[0] == '#')
+			continue;
+
+		if (len > FILTER_PATTERN_LENGTH)
+			len = FILTER_PATTERN_LENGTH;
+
+		for (i = 0; i < (int)len; i++)
+			patterns[count][i] = tolower ((unsigned char)line[i]);
+
+		patterns[count][len] = '\0';
+		size += len;
+		count++;
+	}
+
+	fclose (fp);
+	f = malloc (sizeof (filter_t) + size * sizeof (filter_node_t));
+	fail = malloc (size * sizeof (int));
+	queue = malloc (size * sizeof (int));
+	atomic_init (&f->refs, 1);
+	atomic_init (&f->messages, 0);
+	f->count = count;
+	f->nodes = 1;
+	memset (&f->node[0], 0, sizeof (filter_node_t));
+	f->node[0].out = -1;
+
+	/* Trie of the patterns, 0 is the root so it also stands for no child */
+	for (i = 0; i < count; i++)
+	{
+		strcpy (f->patterns[i], patterns[i]);
+		f->lens[i] = strlen (patterns[i]);
+		atomic_init (&f->hits[i], 0);
+
+		for (u = 0, c = 0; patterns[i][c]; c++)
+		{
+			v = f->node[u].next[(unsigned char)patterns[i][c]];
+
+			if (!v)
+			{
+				v = f->nodes++;
+				memset (&f->node[v], 0, sizeof (filter_node_t));
+				f->node[v].out = -1;
+				f->node[u].next[(unsigned char)patterns[i][c]] = v;
+			}
+
+			u = v;
+		}
+
+		if (f->node[u].out < 0)
+			f->node[u].out = i;
+	}
+
+	/* Breadth first, a node fails to the longest proper suffix in the trie, missing edges take the edge of the failure node */
+	head = tail = 0;
+
+	for (c = 0; c < 256; c++)
+	{
+		if ((v = f->node[0].next[c]))
+		{
+			fail[v] = 0;
+			queue[tail++] = v;
+		}
+	}
+
+	while (head < tail)
+	{
+		u = queue[head++];
+		n = &f->node[u];
+
+		for (c = 0; c < 256; c++)
+		{
+			if ((v = n->next[c]))
+			{
+				fail[v] = f->node[fail[u]].next[c];
+				f->node[v].dict = f->node[fail[v]].out >= 0 ? fail[v] : f->node[fail[v]].dict;
+				queue[tail++] = v;
+			}
+			else
+			{
+				n->next[c] = f->node[fail[u]].next[c];
+			}
+		}
+	}
+
+	/* Patterns are lower case, upper case letters follow the same edges */
+	for (u = 0; u < f->nodes; u++)
+		for (c = 'A'; c <= 'Z'; c++)
+			f->node[u].next[c] = f->node[u].next[tolower (c)];
+
+	free (fail);
+	free (queue);
+	return f;
+}
+
+/* Replace the word filter with the patterns of filter_path, hits carry over for patterns kept */
+int filter_reload (void)
+{
+	filter_t *f = filter_build (filter_path), *old;
+	int i, x, count;
+
+	if (!f)
+		return -1;
+
+	/* A later reload may free f as soon as the lock is released */
+	count = f->count;
+	pthread_mutex_lock (&filter_mutex);
+	old = filter_swap (f);
+
+	if (old)
+	{
+		for (i = 0; i < f->count; i++)
+			for (x = 0; x < old->count; x++)
+				if (!strcmp (f->patterns[i], old->patterns[x]))
+					atomic_store_explicit (&f->hits[i], atomic_load_explicit (&old->hits[x], memory_order_relaxed), memory_order_relaxed);
+
+		atomic_store_explicit (&f->messages, atomic_load_explicit (&old->messages, memory_order_relaxed), memory_order_relaxed);
+		filter_put (old);
+	}
+
+	pthread_mutex_unlock (&filter_mutex);
+	return count;
+}
+
+/* Letters, digits and multibyte characters make up words */
+static int filter_word (unsigned char c)
+{
+	return isalnum (c) || c >= 0x80;
+}
+
+/* Check that a match does not start or end inside a word, "class" does not hit "ass" */
+static int filter_bounded (const char *s, size_t start, size_t end)
+{
+	if (start && filter_word (s[start - 1]) && filter_word (s[start]))
+		return 0;
+
+	return !(filter_word (s[end]) && filter_word (s[end - 1]));
+}
+
+/* Mask the filtered patterns of a room message with stars in one pass, returns the number of hits */
+int filter_apply (char *s)
+{
+	filter_t *f = filter_get ();
+	const filter_node_t *n;
+	int u = 0, hits = 0, d, len, masked;
+	size_t i;
+
+	if (!f)
+		return 0;
+
+	for (i = 0; s[i]; i++)
+	{
+		u = f->node[u].next[(unsigned char)s[i]];
+		n = &f->node[u];
+
+		if (n->out < 0 && !n->dict)
+			continue;
+
+		/* Patterns ending here come longest first, the longest standing as whole words covers the others */
+		for (d = n->out >= 0 ? u : n->dict, masked = 0; d; d = f->node[d].dict)
+		{
+			len = f->lens[f->node[d].out];
+
+			if (!filter_bounded (s, i + 1 - len, i + 1))
+				continue;
+
+			if (!masked)
+			{
+				memset (s + i + 1 - len, '*', len);
+				masked = 1;
+			}
+
+			atomic_fetch_add_explicit (&f->hits[f->node[d].out], 1, memory_order_relaxed);
+			hits++;
+		}
+	}
+
+	if (hits)
+		atomic_fetch_add_explicit (&f->messages, 1, memory_order_relaxed);
+
+	filter_put (f);
+	return hits;
+}
+
+/* Send the filtered patterns and their hits */
+void send_filter (client_t *cli)
+{
+	filter_t *f = filter_get ();
+	char buff_out[FILTER_PATTERN_LENGTH + 64];
+	int i;
+
+	if (!f)
+	{
+		send_message_self ("\r\n\x1B[33mFILTER IS OFF\x1B[37m\r\n\r\n", cli);
+		return;
+	}
+
+	sprintf (buff_out, "\r\n\x1B[33mFILTER\x1B[37m %d patterns, %lu messages masked\r\n", f->count, atomic_load_explicit (&f->messages, memory_order_relaxed));
+	send_message_self (buff_out, cli);
+
+	for (i = 0; i < f->count; i++)
+	{
+		sprintf (buff_out, "  %-*s %lu\r\n", FILTER_PATTERN_LENGTH / 2, f->patterns[i], atomic_load_explicit (&f->hits[i], memory_order_relaxed));
+		send_message_self (buff_out, cli);
+	}
+
+	send_message_self ("\r\n", cli);
+	filter_put (f);
+}
+
+/* Record a message in the room history and the log */
+void record_message (client_t *cli, const char *s)
+{
+	top_count (cli->name, cli->room, strlen (s));
+	room_count (cli->rm, strlen (s));
+	history_add (cli->rm, s, cli->name);
+	log_append (cli->room, cli->name, s);
+}
+
+/* Split the first space separated word off *p in place, NULL if there is none */
+char *next_word (char **p)
+{
+	char *s = *p, *word;
+
+	while (*s == ' ')
+		s++;
+
+	if (!*s)
+	{
+		*p = s;
+		return NULL;
+	}
+
+	word = s;
+
+	while (*s && *s != ' ')
+		s++;
+
+	if (*s)
+		*s++ = '\0';
+
+	while (*s == ' ')
+		s++;
+
+	*p = s;
+	return word;
+}
+
+/* Copy the parts of a message after each other, returns the length */
+size_t iov_gather (char *dst, const struct iovec *iov, int n)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		memcpy (dst + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+
+	dst[len] = '\0';
+	return len;
+}
+
+/* Broadcast the chat lines gathered from one read as a single payload */
+void send_burst (client_t *cli, char *s, int len)
+{
+	if (len <= 0)
+		return;
+
+	if (cli->echo)
+		send_message_all (s, cli->room, cli->name);
+	else
+		send_message_except_self (s, cli->room, cli->name, cli->uid);
+}
+
+/* Serialize the state of a client, returns the encoded length */
+size_t state_encode (char *buf, const client_state_t *st)
+{
+	state_record_t rec;
+	char *p = buf + sizeof (rec);
+
+	rec.token = st->token;
+	rec.addr = st->addr;
+	rec.echo = st->echo;
+	rec.name_len = strlen (st->name);
+	rec.room_len = strlen (st->room);
+	rec.status_len = strlen (st->status);
+	rec.mute_len = strlen (st->mute);
+	memcpy (buf, &rec, sizeof (rec));
+	memcpy (p, st->name, rec.name_len);
+	p += rec.name_len;
+	memcpy (p, st->room, rec.room_len);
+	p += rec.room_len;
+	memcpy (p, st->status, rec.status_len);
+	p += rec.status_len;
+	memcpy (p, st->mute, rec.mute_len);
+	return p + rec.mute_len - buf;
+}
+
+/* Parse one encoded client state, returns the bytes consumed or 0 if invalid */
+size_t state_decode (const char *buf, size_t len, client_state_t *st)
+{
+	state_record_t rec;
+	const char *p = buf + sizeof (rec);
+
+	if (len < sizeof (rec))
+		return 0;
+
+	memcpy (&rec, buf, sizeof (rec));
+
+	if (rec.name_len > MAX_NAME_LENGTH || rec.room_len > MAX_NAME_LENGTH || rec.status_len > MAX_SHORT_MESSAGE_LENGTH
+			|| rec.mute_len > MAX_SHORT_MESSAGE_LENGTH || len < sizeof (rec) + rec.name_len + rec.room_len + rec.status_len + rec.mute_len)
+		return 0;
+
+	st->token = rec.token;
+	st->addr = rec.addr;
+	st->echo = rec.echo;
+	memcpy (st->name, p, rec.name_len);
+	st->name[rec.name_len] = '\0';
+	p += rec.name_len;
+	memcpy (st->room, p, rec.room_len);
+	st->room[rec.room_len] = '\0';
+	p += rec.room_len;
+	memcpy (st->status, p, rec.status_len);
+	st->status[rec.status_len] = '\0';
+	p += rec.status_len;
+	memcpy (st->mute, p, rec.mute_len);
+	st->mute[rec.mute_len] = '\0';
+	return p + rec.mute_len - buf;
+}
+
+/* Copy the persistent part of a client */
+void state_capture (client_state_t *st, const client_t *cli)
+{
+	st->token = cli->token;
+	st->addr = cli->addr.sin_addr.s_addr;
+	st->echo = cli->echo;
+	/* Fields may be rewritten by the owning thread, keep every copy terminated */
+	memcpy (st->name, cli->name, sizeof (st->name));
+	st->name[MAX_NAME_LENGTH] = '\0';
+	memcpy (st->room, cli->room, sizeof (st->room));
+	st->room[MAX_NAME_LENGTH] = '\0';
+	memcpy (st->status, cli->status, sizeof (st->status));
+	st->status[MAX_SHORT_MESSAGE_LENGTH] = '\0';
+	memcpy (st->mute, cli->mute, sizeof (st->mute));
+	st->mute[MAX_SHORT_MESSAGE_LENGTH] = '\0';
+}
+
+/* Write the state of every client to the snapshot file */
+int snapshot_write (void)
+{
+	static client_state_t states[MAX_CLIENTS * 2];
+	static char buff[MAX_CLIENTS * 2 * sizeof (state_record_t) + sizeof (states)];
+	char path[PATH_MAX + 8];
+	snapshot_header_t hdr;
+	size_t len = sizeof (hdr);
+	int i, n = 0, fd;
+
+	/* Copy under the lock, encode and write outside of it */
+	pthread_mutex_lock (&clients_mutex);
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		if (clients[i])
+			state_capture (&states[n++], clients[i]);
+	}
+
+	/* Keep sessions that did not come back yet */
+	if (time (NULL) < restore_deadline)
+	{
+		for (i = 0; i < restore_count; i++)
+		{
+			if (!restore_claimed[i])
+				states[n++] = restore[i];
+		}
+	}
+
+	pthread_mutex_unlock (&clients_mutex);
+
+	for (i = 0; i < n; i++)
+		len += state_encode (buff + len, &states[i]);
+
+	memcpy (hdr.magic, SNAPSHOT_MAGIC, sizeof (hdr.magic));
+	hdr.count = n;
+	memcpy (buff, &hdr, sizeof (hdr));
+
+	/* Replace the file atomically so a crash leaves the previous snapshot */
+	snprintf (path, sizeof (path), "%s.tmp", snapshot_path);
+	fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0)
+		return -1;
+
+	if (write (fd, buff, len) != len || fdatasync (fd) < 0)
+	{
+		close (fd);
+		unlink (path);
+		return -1;
+	}
+
+	close (fd);
+	return rename (path, snapshot_path);
+}
+
+/* Periodic snapshot thread */
+void *snapshot_writer (void *arg)
+{
+	while (1)
+	{
+		sleep (SNAPSHOT_INTERVAL);
+
+		if (snapshot_write () < 0)
+			perror ("\x1B[34mSnapshot write failed\x1B[37m");
+	}
+
+	return NULL;
+}
+
+/* Load the previous snapshot and start writing new ones */
+int snapshot_init (const char *path)
+{
+	snapshot_header_t hdr;
+	struct stat st;
+	const char *map, *p;
+	size_t used;
+	pthread_t tid;
+	int fd, i;
+
+	strncpy (snapshot_path, path, sizeof (snapshot_path) - 1);
+	fd = open (snapshot_path, O_RDONLY);
+
+	if (fd >= 0)
+	{
+		if (fstat (fd, &st) == 0 && st.st_size >= sizeof (hdr))
+		{
+			map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+			if (map != MAP_FAILED)
+			{
+				memcpy (&hdr, map, sizeof (hdr));
+
+				if (!memcmp (hdr.magic, SNAPSHOT_MAGIC, sizeof (hdr.magic)))
+				{
+					p = map + sizeof (hdr);
+
+					for (i = 0; i < hdr.count && restore_count < MAX_CLIENTS; i++, p += used)
+					{
+						used = state_decode (p, map + st.st_size - p, &restore[restore_count]);
+
+						if (!used)
+							break;
+
+						restore_count++;
+					}
+				}
+
+				munmap ((void *)map, st.st_size);
+			}
+		}
+
+		close (fd);
+	}
+
+	restore_deadline = time (NULL) + SNAPSHOT_RESTORE_WINDOW;
+	pthread_create (&tid, NULL, &snapshot_writer, NULL);
+	pthread_detach (tid);
+	return 0;
+}
+
+/* Give a reconnecting client the state saved under its session token.
+ * Returns 1 and the saved name and room, which the caller takes on */
+int snapshot_restore (client_t *cli, uint64_t token, char *name, char *room)
+{
+	client_state_t *st = NULL;
+	int i;
+
+	if (!token)
+		return 0;
+
+	pthread_mutex_lock (&clients_mutex);
+
+	if (time (NULL) < restore_deadline)
+	{
+		for (i = 0; i < restore_count; i++)
+		{
+			if (!restore_claimed[i] && restore[i].token == token)
+			{
+				restore_claimed[i] = 1;
+				st = &restore[i];
+				break;
+			}
+		}
+	}
+
+	if (st)
+	{
+		strcpy (name, st->name);
+		strcpy (room, st->room);
+		strcpy (cli->status, st->status);
+		strcpy (cli->mute, st->mute);
+		cli->echo = st->echo;
+		cli->token = token;
+	}
+
+	pthread_mutex_unlock (&clients_mutex);
+	return st != NULL;
+}
+
+/* Interrupts blocking calls of a thread, installed without SA_RESTART */
+static void handoff_signal (int sig)
+{
+}
+
+/* Block the calling thread while a handoff is running */
+void handoff_park (void)
+{
+	pthread_mutex_lock (&handoff_mutex);
+
+	if (handoff_active)
+	{
+		handoff_parked++;
+		pthread_cond_broadcast (&handoff_cond);
+
+		while (handoff_active)
+			pthread_cond_wait (&handoff_cond, &handoff_mutex);
+
+		handoff_parked--;
+	}
+
+	pthread_mutex_unlock (&handoff_mutex);
+}
+
+/* Read from a client, parking instead of consuming input during a handoff */
+int client_read (client_t *cli, char *buf, size_t len)
+{
+	unsigned long t;
+	int rlen;
+
+	do
+	{
+		handoff_park ();
+		t = trace_begin ();
+		rlen = read (cli->connfd, buf, len);
+		trace_end ("read", t);
+	}
+	while (rlen < 0 && errno == EINTR);
+
+	return rlen;
+}
+
+/* Stop accepting and reading until every thread is parked, returns 0 on success */
+int handoff_freeze (void)
+{
+	int i, threads, waited;
+
+	pthread_mutex_lock (&handoff_mutex);
+	handoff_active = 1;
+	pthread_mutex_unlock (&handoff_mutex);
+
+	/* A thread can miss a signal right before it blocks, so keep poking */
+	for (waited = 0; waited < HANDOFF_FREEZE_TIMEOUT; waited += 10)
+	{
+		threads = 1;
+		pthread_kill (main_tid, SIGUSR1);
+		pthread_mutex_lock (&clients_mutex);
+
+		for (i = 0; i < MAX_CLIENTS; i++)
+		{
+			if (clients[i])
+			{
+				threads++;
+				pthread_kill (clients[i]->tid, SIGUSR1);
+			}
+		}
+
+		pthread_mutex_unlock (&clients_mutex);
+		usleep (10000);
+		pthread_mutex_lock (&handoff_mutex);
+		i = handoff_parked;
+		pthread_mutex_unlock (&handoff_mutex);
+
+		if (i >= threads)
+			return 0;
+	}
+
+	return -1;
+}
+
+/* Let parked threads carry on after a failed handoff */
+void handoff_thaw (void)
+{
+	pthread_mutex_lock (&handoff_mutex);
+	handoff_active = 0;
+	pthread_cond_broadcast (&handoff_cond);
+	pthread_mutex_unlock (&handoff_mutex);
+}
+
+/* Send a message with file descriptors attached */
+int handoff_send (int sock, const void *buf, size_t len, const int *fds, int nfds)
+{
+	char control[CMSG_SPACE (HANDOFF_BATCH * sizeof (int))];
+	struct iovec iov = {(void *)buf, len};
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+
+	memset (&msg, 0, sizeof (msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (nfds)
+	{
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE (nfds * sizeof (int));
+		cmsg = CMSG_FIRSTHDR (&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN (nfds * sizeof (int));
+		memcpy (CMSG_DATA (cmsg), fds, nfds * sizeof (int));
+	}
+
+	return sendmsg (sock, &msg, 0) == len ? 0 : -1;
+}
+
+/* Receive a message and the file descriptors attached, returns the payload length */
+int handoff_recv (int sock, void *buf, size_t len, int *fds, int *nfds)
+{
+	char control[CMSG_SPACE (HANDOFF_BATCH * sizeof (int))];
+	struct iovec iov = {buf, len};
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int rlen;
+
+	memset (&msg, 0, sizeof (msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof (control);
+	*nfds = 0;
+	rlen = recvmsg (sock, &msg, 0);
+
+	for (cmsg = CMSG_FIRSTHDR (&msg); rlen > 0 && cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		{
+			*nfds = (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+			memcpy (fds, CMSG_DATA (cmsg), *nfds * sizeof (int));
+		}
+	}
+
+	return rlen;
+}
+
+/* Hand the listening socket and every client over to a new process */
+int handoff_give (int sock)
+{
+	static char buff[HANDOFF_BATCH * (sizeof (state_record_t) + sizeof (client_state_t) + 2 * sizeof (uint32_t))];
+	client_state_t st;
+	handoff_header_t hdr;
+	int fds[HANDOFF_BATCH];
+	uint32_t uid, len;
+	size_t used = 0;
+	int i, n = 0;
+
+	if (handoff_freeze () < 0)
+		return -1;
+
+	/* Everything is parked, only this thread touches the clients now */
+	log_flush ();
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		if (clients[i])
+			client_flush (clients[i]);
+	}
+
+	memcpy (hdr.magic, HANDOFF_MAGIC, sizeof (hdr.magic));
+	hdr.count = 0;
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		if (clients[i])
+			hdr.count++;
+	}
+
+	if (handoff_send (sock, &hdr, sizeof (hdr), &listen_fd, 1) < 0)
+		return -1;
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		if (!clients[i])
+			continue;
+
+		/* Each entry is the uid, the state length and the encoded state */
+		state_capture (&st, clients[i]);
+		uid = clients[i]->uid;
+		len = state_encode (buff + used + 2 * sizeof (uint32_t), &st);
+		memcpy (buff + used, &uid, sizeof (uid));
+		memcpy (buff + used + sizeof (uid), &len, sizeof (len));
+		used += 2 * sizeof (uint32_t) + len;
+		fds[n++] = clients[i]->connfd;
+
+		if (n == HANDOFF_BATCH)
+		{
+			if (handoff_send (sock, buff, used, fds, n) < 0)
+				return -1;
+
+			used = n = 0;
+		}
+	}
+
+	if (n && handoff_send (sock, buff, used, fds, n) < 0)
+		return -1;
+
+	/* The new process acknowledges once it owns everything */
+	return read (sock, buff, 1) == 1 ? 0 : -1;
+}
+
+/* Wait for a new process asking to take over */
+void *handoff_listener (void *arg)
+{
+	int sock;
+	char req;
+
+	while (1)
+	{
+		sock = accept (handoff_fd, NULL, NULL);
+
+		if (sock < 0)
+			continue;
+
+		if (read (sock, &req, 1) == 1 && req == 'U' && handoff_give (sock) == 0)
+		{
+			/* Client sockets live on in the new process */
+			exit (0);
+		}
+
+		handoff_thaw ();
+		close (sock);
+	}
+
+	return NULL;
+}
+
+/* Listen for takeover requests on a unix socket */
+int handoff_init (const char *path)
+{
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	pthread_t tid;
+
+	memset (&sa, 0, sizeof (sa));
+	sa.sa_handler = handoff_signal;
+	sigaction (SIGUSR1, &sa, NULL);
+	main_tid = pthread_self ();
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strncpy (addr.sun_path, path, sizeof (addr.sun_path) - 1);
+	handoff_fd = socket (AF_UNIX, SOCK_SEQPACKET, 0);
+	unlink (addr.sun_path);
+
+	/* Whoever connects gets every live connection, only the owner may. Nobody can connect before listen */
+	if (bind (handoff_fd, (struct sockaddr *)&addr, sizeof (addr)) < 0 || chmod (addr.sun_path, 0600) < 0 || listen (handoff_fd, 1) < 0)
+		return -1;
+
+	pthread_create (&tid, NULL, &handoff_listener, NULL);
+	pthread_detach (tid);
+	return 0;
+}
+
+/* Take over from a running process, returns the listening socket or -1 if there is none */
+int handoff_take (const char *path)
+{
+	static char buff[HANDOFF_BATCH * (sizeof (state_record_t) + sizeof (client_state_t) + 2 * sizeof (uint32_t))];
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	handoff_header_t hdr;
+	client_state_t st;
+	client_t *cli;
+	int fds[HANDOFF_BATCH];
+	int sock, fd = -1, nfds, rlen, i, adopted = 0;
+	uint32_t uid, len;
+	size_t used;
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strncpy (addr.sun_path, path, sizeof (addr.sun_path) - 1);
+	sock = socket (AF_UNIX, SOCK_SEQPACKET, 0);
+
+	if (connect (sock, (struct sockaddr *)&addr, sizeof (addr)) < 0 || write (sock, "U", 1) != 1)
+	{
+		close (sock);
+		return -1;
+	}
+
+	rlen = handoff_recv (sock, &hdr, sizeof (hdr), fds, &nfds);
+
+	if (rlen != sizeof (hdr) || nfds != 1 || memcmp (hdr.magic, HANDOFF_MAGIC, sizeof (hdr.magic)))
+	{
+		close (sock);
+		return -1;
+	}
+
+	fd = fds[0];
+
+	while (adopted < hdr.count)
+	{
+		rlen = handoff_recv (sock, buff, sizeof (buff), fds, &nfds);
+
+		if (rlen <= 0)
+			break;
+
+		for (i = 0, used = 0; i < nfds && used + 2 * sizeof (uint32_t) <= rlen; i++, adopted++)
+		{
+			memcpy (&uid, buff + used, sizeof (uid));
+			memcpy (&len, buff + used + sizeof (uid), sizeof (len));
+			used += 2 * sizeof (uint32_t);
+
+			if (uid >= MAX_CLIENTS || clients[uid] || !state_decode (buff + used, rlen - used, &st))
+			{
+				close (fds[i]);
+				used += len;
+				continue;
+			}
+
+			used += len;
+			/* Threads are started by main once the rest of the server is up */
+			cli = (client_t *)calloc (1, sizeof (client_t));
+			cli->connfd = fds[i];
+			cli->uid = uid;
+			addrlen = sizeof (cli->addr);
+			getpeername (cli->connfd, (struct sockaddr *)&cli->addr, &addrlen);
+			strcpy (cli->name, st.name);
+			strcpy (cli->room, st.room);
+			strcpy (cli->status, st.status);
+			strcpy (cli->mute, st.mute);
+			cli->echo = st.echo;
+			cli->token = st.token;
+			cli->resumed = 1;
+			client_output_init (cli);
+			admit_take (cli->addr.sin_addr.s_addr, 0);
+			clients[uid] = cli;
+			atomic_fetch_add_explicit (&cli_count, 1, memory_order_relaxed);
+		}
+	}
+
+	if (write (sock, "K", 1) != 1)
+		perror ("\x1B[34mHandoff acknowledge failed\x1B[37m");
+
+	close (sock);
+	return fd;
+}
+
+/* Trim leading and trailing blanks in place */
+char *trim (char *s)
+{
+	char *end;
+
+	while (*s == ' ' || *s == '\t')
+		s++;
+
+	end = s + strlen (s);
+
+	while (end > s && (end[-1] == ' ' || end[-1] == '\t'))
+		*--end = '\0';
+
+	return s;
+}
+
+/* Check a math identifier, tinyexpr only accepts lower case names */
+int math_valid_name (const char *s)
+{
+	int len = 0;
+
+	if (*s < 'a' || *s > 'z')
+		return 0;
+
+	for (; *s; s++, len++)
+	{
+		if (!((*s >= 'a' && *s <= 'z') || (*s >= '0' && *s <= '9') || *s == '_'))
+			return 0;
+	}
+
+	return len <= MAX_NAME_LENGTH;
+}
+
+/* Get the math environment of a client, allocate it on first use */
+math_env_t *math_env (client_t *cli)
+{
+	if (!cli->math)
+		cli->math = (math_env_t *)calloc (1, sizeof (math_env_t));
+
+	return cli->math;
+}
+
+/* Free a math environment and all compiled expressions */
+void math_env_free (math_env_t *env)
+{
+	int i;
+
+	if (!env)
+		return;
+
+	for (i = 0; i < env->var_count; i++)
+		te_free (env->vars[i].expr);
+
+	for (i = 0; i < env->func_count; i++)
+		te_free (env->funcs[i].body);
+
+	free (env);
+}
+
+/* Evaluate a user function, called by tinyexpr as a closure */
+static double math_call (void *context, double a)
+{
+	math_func_t *f = (math_func_t *)context;
+	double saved, r;
+
+	/* There are no conditionals, so any recursion is unbounded */
+	if (!f->body || f->depth >= MAX_MATH_DEPTH)
+		return NAN;
+
+	saved = f->arg;
+	f->arg = a;
+	f->depth++;
+	r = te_eval (f->body);
+	f->depth--;
+	f->arg = saved;
+	return r;
+}
+
+/* Fill the tinyexpr binding table, the parameter of self shadows everything else */
+int math_bindings (math_env_t *env, te_variable *vars, math_func_t *self)
+{
+	int i, n = 0;
+
+	if (self)
+	{
+		vars[n].name = self->param;
+		vars[n].address = &self->arg;
+		vars[n].type = TE_VARIABLE;
+		vars[n++].context = NULL;
+	}
+
+	for (i = 0; i < env->var_count; i++)
+	{
+		vars[n].name = env->vars[i].name;
+		vars[n].address = &env->vars[i].value;
+		vars[n].type = TE_VARIABLE;
+		vars[n++].context = NULL;
+	}
+
+	for (i = 0; i < env->func_count; i++)
+	{
+		vars[n].name = env->funcs[i].name;
+		vars[n].address = math_call;
+		vars[n].type = TE_CLOSURE1;
+		vars[n++].context = &env->funcs[i];
 	}
+
+	return n;
 }
 
-/* Strip CRLF */
-void strip_newline (char *s)
+/* Collect the variables and functions referenced by a compiled expression */
+void math_scan (math_env_t *env, const te_expr *n, unsigned int *vdeps, unsigned int *fdeps)
 {
-	while (*s != '\0')
+	int i, arity;
+
+	if (!n)
+		return;
+
+	if ((n->type & 0x1F) == TE_VARIABLE)
 	{
-		if (*s == '\r' || *s == '\n')
+		for (i = 0; i < env->var_count; i++)
 		{
-			*s = '\0';
+			if (n->bound == &env->vars[i].value)
+				*vdeps |= 1u << i;
 		}
 
-		s++;
+		return;
 	}
-}
 
-/* Add client to queue */
-void queue_add (client_t *cl)
-{
-	int i;
+	if (!(n->type & (TE_FUNCTION0 | TE_CLOSURE0)))
+		return;
 
-	for (i = 0; i < MAX_CLIENTS; i++)
+	arity = n->type & 7;
+
+	for (i = 0; i < arity; i++)
+		math_scan (env, (const te_expr *)n->parameters[i], vdeps, fdeps);
+
+	/* Closures keep their context after the arguments */
+	if (n->type & TE_CLOSURE0)
 	{
-		if (!clients[i])
+		for (i = 0; i < env->func_count; i++)
 		{
-			clients[i] = cl;
-			return;
+			if (n->parameters[arity] == &env->funcs[i])
+				*fdeps |= 1u << i;
 		}
 	}
 }
 
-/* Delete client from queue */
-void queue_delete (int uid)
+/* Expand dependencies through the bodies of the functions called */
+void math_closure (math_env_t *env, unsigned int *vdeps, unsigned int *fdeps)
 {
+	unsigned int seen = 0;
 	int i;
 
-	for (i = 0; i < MAX_CLIENTS; i++)
+	while (*fdeps & ~seen)
 	{
-		if (clients[i])
-		{
-			if (clients[i]->uid == uid)
-			{
-				clients[i] = NULL;
-				return;
-			}
-		}
+		for (i = 0; !((*fdeps & ~seen) & (1u << i)); i++);
+
+		seen |= 1u << i;
+		*vdeps |= env->funcs[i].vdeps;
+		*fdeps |= env->funcs[i].fdeps;
 	}
 }
 
-/* Send message to all clients in the same room */
-void send_message_all (char *s, char *room, char *name)
+/* Re-evaluate only the variables depending on what changed, returns the number of updates */
+int math_propagate (math_env_t *env, unsigned int vchanged, unsigned int fchanged)
 {
-	int i;
-	char cmpname[MAX_NAME_LENGTH + 3];
-	strcpy (cmpname, "|");
-	strcat (cmpname, name);
-	strcat (cmpname, "|");
+	int i, pass, updated = 0;
 
-	for (i = 0; i < MAX_CLIENTS; i++)
+	/* Cycles can only be built by redefinition, bound them to one pass per variable */
+	for (pass = 0; pass < MAX_MATH_VARS && (vchanged || fchanged); pass++)
 	{
-		if (clients[i])
+		unsigned int next = 0;
+
+		for (i = 0; i < env->var_count; i++)
 		{
-			if (!strcicmp (clients[i]->room, room) && strcicmp (clients[i]->mute, cmpname))
+			unsigned int vdeps = env->vars[i].vdeps;
+			unsigned int fdeps = env->vars[i].fdeps;
+			math_closure (env, &vdeps, &fdeps);
+
+			if ((vdeps & vchanged) || (fdeps & fchanged))
 			{
-				if (write (clients[i]->connfd, s, strlen (s)) != strlen (s))
-					continue;
+				env->vars[i].value = te_eval (env->vars[i].expr);
+				next |= 1u << i;
+				updated++;
 			}
 		}
+
+		vchanged = next;
+		fchanged = 0;
 	}
+
+	return updated;
 }
 
-/* Send message to all clients in the same room except yourself */
-void send_message_except_self (char *s, char *room, char *name, int uid)
+/* Find a variable by name */
+math_var_t *math_find_var (math_env_t *env, const char *name)
 {
 	int i;
-	char cmpname[MAX_NAME_LENGTH + 3];
-	strcpy (cmpname, "|");
-	strcat (cmpname, name);
-	strcat (cmpname, "|");
 
-	for (i = 0; i < MAX_CLIENTS; i++)
+	for (i = 0; i < env->var_count; i++)
 	{
-		if (clients[i])
-		{
-			if (!strcicmp (clients[i]->room, room) && strcicmp (clients[i]->mute, cmpname))
-			{
-				if (clients[i]->uid != uid)
-				{
-					if (write (clients[i]->connfd, s, strlen (s)) != strlen (s))
-						continue;
-				}
-			}
-		}
+		if (!strcmp (env->vars[i].name, name))
+			return &env->vars[i];
 	}
+
+	return NULL;
 }
 
-/* Send message to sender */
-void send_message_self (const char *s, int connfd)
+/* Find a function by name */
+math_func_t *math_find_func (math_env_t *env, const char *name)
 {
-	if (write (connfd, s, strlen (s)) != strlen (s))
-		return;
+	int i;
+
+	for (i = 0; i < env->func_count; i++)
+	{
+		if (!strcmp (env->funcs[i].name, name))
+			return &env->funcs[i];
+	}
+
+	return NULL;
 }
 
-/* Send message to specific client, regardless of room */
-void send_message_client (char *s, char *name, int uid)
+/* Define or redefine a variable, returns an error message or NULL */
+const char *math_let (math_env_t *env, const char *name, const char *text, int *updated)
 {
-	int i;
-	char cmpname[MAX_NAME_LENGTH + 3];
-	strcpy (cmpname, "|");
-	strcat (cmpname, name);
-	strcat (cmpname, "|");
+	te_variable vars[MAX_MATH_VARS + MAX_MATH_FUNCS + 1];
+	math_var_t *v;
+	te_expr *expr;
+	int i, err;
 
-	for (i = 0; i < MAX_CLIENTS; i++)
+	if (!math_valid_name (name))
+		return "INVALID NAME";
+
+	if (math_find_func (env, name))
+		return "NAME ALREADY EXISTS";
+
+	v = math_find_var (env, name);
+
+	if (!v && env->var_count == MAX_MATH_VARS)
+		return "TOO MANY VARIABLES";
+
+	/* A redefinition sees its own previous value */
+	expr = te_compile (text, vars, math_bindings (env, vars, NULL), &err);
+
+	if (!expr)
+		return "MATH SYNTAX ERROR";
+
+	if (!v)
 	{
-		if (clients[i])
-		{
-			if (clients[i]->uid == uid && strcicmp (clients[i]->mute, cmpname))
-			{
-				if (write (clients[i]->connfd, s, strlen (s)) != strlen (s))
-					continue;
-			}
-		}
+		v = &env->vars[env->var_count++];
+		strcpy (v->name, name);
 	}
+
+	i = v - env->vars;
+	te_free (v->expr);
+	v->expr = expr;
+	strncpy (v->text, text, MAX_SHORT_MESSAGE_LENGTH);
+	v->text[MAX_SHORT_MESSAGE_LENGTH] = '\0';
+	v->vdeps = v->fdeps = 0;
+	math_scan (env, expr, &v->vdeps, &v->fdeps);
+	v->vdeps &= ~(1u << i);
+	v->value = te_eval (expr);
+	*updated = math_propagate (env, 1u << i, 0);
+	return NULL;
 }
 
-/* Send list of active clients */
-void send_active_clients (int connfd)
+/* Define or redefine a single parameter function, returns an error message or NULL */
+const char *math_def (math_env_t *env, const char *name, const char *param, const char *text, int *updated)
 {
-	int i;
-	char s[MAX_SHORT_MESSAGE_LENGTH + 64];
+	te_variable vars[MAX_MATH_VARS + MAX_MATH_FUNCS + 1];
+	char saved[MAX_NAME_LENGTH + 1];
+	unsigned int vdeps = 0, fdeps = 0;
+	math_func_t *f;
+	te_expr *body;
+	int err;
 
-	for (i = 0; i < MAX_CLIENTS; i++)
+	if (!math_valid_name (name) || !math_valid_name (param) || !strcmp (name, param))
+		return "INVALID NAME";
+
+	if (math_find_var (env, name))
+		return "NAME ALREADY EXISTS";
+
+	f = math_find_func (env, name);
+
+	if (!f && env->func_count == MAX_MATH_FUNCS)
+		return "TOO MANY FUNCTIONS";
+
+	/* A new function is not bound yet, only a redefinition may call itself */
+	if (!f)
 	{
-		if (clients[i])
-		{
-			sprintf (s, "  %s<%s>[%s] %s\x1B[37m\r\n", colors[clients[i]->uid % 4], clients[i]->room, clients[i]->name, clients[i]->status);
-			send_message_self (s, connfd);
-		}
+		f = &env->funcs[env->func_count];
+		memset (f, 0, sizeof (math_func_t));
+	}
+
+	/* The body binds the parameter by name, the old one is put back if it is refused */
+	strcpy (saved, f->param);
+	strcpy (f->param, param);
+	body = te_compile (text, vars, math_bindings (env, vars, f), &err);
+
+	if (!body)
+	{
+		strcpy (f->param, saved);
+		return "MATH SYNTAX ERROR";
+	}
+
+	/* Calls that lead back to the function would branch without end, refuse them up front */
+	math_scan (env, body, &vdeps, &fdeps);
+	math_closure (env, &vdeps, &fdeps);
+
+	if (fdeps & (1u << (f - env->funcs)))
+	{
+		te_free (body);
+		strcpy (f->param, saved);
+		return "RECURSIVE FUNCTION";
+	}
+
+	if (f == &env->funcs[env->func_count])
+	{
+		strcpy (f->name, name);
+		env->func_count++;
 	}
+
+	te_free (f->body);
+	f->body = body;
+	strncpy (f->text, text, MAX_SHORT_MESSAGE_LENGTH);
+	f->text[MAX_SHORT_MESSAGE_LENGTH] = '\0';
+	f->vdeps = f->fdeps = 0;
+	math_scan (env, body, &f->vdeps, &f->fdeps);
+	*updated = math_propagate (env, 0, 1u << (f - env->funcs));
+	return NULL;
+}
+
+/* Evaluate an expression against the client variables and functions */
+double math_eval (math_env_t *env, const char *text)
+{
+	te_variable vars[MAX_MATH_VARS + MAX_MATH_FUNCS + 1];
+	te_expr *expr;
+	double r;
+	int err;
+
+	expr = te_compile (text, vars, math_bindings (env, vars, NULL), &err);
+
+	if (!expr)
+		return NAN;
+
+	r = te_eval (expr);
+	te_free (expr);
+	return r;
 }
 
-/* Send list of active clients in a specific room */
-void send_active_clients_room (int connfd, char *room)
+/* Send the variables and functions of a client */
+void send_math_env (math_env_t *env, client_t *cli)
 {
+	char s[MAX_SHORT_MESSAGE_LENGTH + 2 * MAX_NAME_LENGTH + 64];
 	int i;
-	char s[MAX_SHORT_MESSAGE_LENGTH + 64];
 
-	for (i = 0; i < MAX_CLIENTS; i++)
+	for (i = 0; i < env->var_count; i++)
 	{
-		if (clients[i])
-		{
-			if (!strcicmp (clients[i]->room, room))
-			{
-				sprintf (s, "  %s[%s] %s\x1B[37m\r\n", colors[clients[i]->uid % 4], clients[i]->name, clients[i]->status);
-				send_message_self (s, connfd);
-			}
-		}
+		sprintf (s, "  %s = %g\x1B[33m  [%s]\x1B[37m\r\n", env->vars[i].name, env->vars[i].value, env->vars[i].text);
+		send_message_self (s, cli);
+	}
+
+	for (i = 0; i < env->func_count; i++)
+	{
+		sprintf (s, "  %s(%s) = %s\r\n", env->funcs[i].name, env->funcs[i].param, env->funcs[i].text);
+		send_message_self (s, cli);
 	}
 }
 
 /* Show Help */
-void send_help (int connfd)
+void send_help (client_t *cli)
 {
-	char buff_out[MAX_BUFFER_LENGTH];
+	char buff_out[MAX_BUFFER_LENGTH * 4];
 	strcpy (buff_out, "\r\n\x1B[33m     **** Commands ****\r\n");
 	strcat (buff_out, "\x1B[33m\\quit\x1B[37m     Quit chatroom\r\n");
 	strcat (buff_out, "\x1B[33m\\me\x1B[37m       <message> Emote\r\n");
 	strcat (buff_out, "\x1B[33m\\ping\x1B[37m     Server test\r\n");
 	strcat (buff_out, "\x1B[33m\\nick\x1B[37m     <nickname> Change nickname\r\n");
 	strcat (buff_out, "\x1B[33m\\pm\x1B[37m       <nickname> <message> Send private message regardless of recipient room\r\n");
-	strcat (buff_out, "\x1B[33m\\who\x1B[37m      Show active clients\r\n");
+	strcat (buff_out, "\x1B[33m\\who\x1B[37m      <prefix> <page> Show active clients, or a page of those whose name starts with prefix (* for all)\r\n");
 	strcat (buff_out, "\x1B[33m\\help\x1B[37m     Show this help screen\r\n");
 	strcat (buff_out, "\x1B[33m\\room\x1B[37m     <room_name> Move to another room or show who is in the current room\r\n");
+	strcat (buff_out, "\x1B[33m\\history\x1B[37m  <count> Show the latest messages of the room\r\n");
+	strcat (buff_out, "\x1B[33m\\roomstats\x1B[37m <room_name> Show traffic of a room, or of every room in use\r\n");
 	strcat (buff_out, "\x1B[33m\\time\x1B[37m     Show the current server time\r\n");
+	strcat (buff_out, "\x1B[33m\\stats\x1B[37m    Show server counters and connection latency (admin)\r\n");
+	strcat (buff_out, "\x1B[33m\\admin\x1B[37m    <password> Allow admin commands\r\n");
+	strcat (buff_out, "\x1B[33m\\trace\x1B[37m    Write the recorded trace (admin)\r\n");
+	strcat (buff_out, "\x1B[33m\\top\x1B[37m      <reset> Show the senders and rooms with the most traffic (admin)\r\n");
+	strcat (buff_out, "\x1B[33m\\filter\x1B[37m   <reload> Show the word filter hits, or reload its patterns (admin)\r\n");
+	strcat (buff_out, "\x1B[33m\\resume\x1B[37m   <token> Take back the name, room, status and mutes of a session after a server restart\r\n");
 	strcat (buff_out, "\x1B[33m\\math\x1B[37m     <expression> Evaluate a math expression\r\n");
+	strcat (buff_out, "\x1B[33m\\let\x1B[37m      <name> = <expression> Set a math variable. Without parameters list variables and functions\r\n");
+	strcat (buff_out, "\x1B[33m\\def\x1B[37m      <name>(<param>) = <expression> Define a math function\r\n");
 	strcat (buff_out, "\x1B[33m\\roll\x1B[37m     <die_sides> Roll dice\r\n");
 	strcat (buff_out, "\x1B[33m\\echo\x1B[37m     <on/off> Set local echo\r\n");
 	strcat (buff_out, "\x1B[33m\\bell\x1B[37m     <nickname> Ring Terminal Bell\r\n");
 	strcat (buff_out, "\x1B[33m\\mute\x1B[37m     <nickname_list> List of Nicknames to mute. Clear mute if the list is empty\r\n");
 	strcat (buff_out, "\x1B[33m\\away\x1B[37m     <short_message> Let others know your status. If no message, away status is cleared\r\n\r\n");
-	send_message_self (buff_out, connfd);
+	send_message_self (buff_out, cli);
+}
+
+/* Rate limit class of a command, -1 if it is not limited */
+int command_class (int cmd)
+{
+	switch (cmd)
+	{
+		case 3: /* Private */
+		case 13: /* Bell */
+			return RATE_DIRECT;
+
+		case 5: /* Me */
+		case 11: /* Roll Dice */
+			return RATE_MESSAGE;
+
+		case 4: /* Who */
+		case 9: /* Math */
+		case 15: /* Let */
+		case 16: /* Def */
+		case 17: /* History */
+		case 18: /* Stats */
+		case 19: /* Admin */
+		case 20: /* Trace */
+		case 21: /* Top */
+		case 22: /* Room Stats */
+		case 23: /* Filter */
+		case 24: /* Resume */
+			return RATE_COMMAND;
+	}
+
+	return -1;
+}
+
+/* Move a client to another room, telling both rooms */
+void room_move (client_t *cli, const char *room)
+{
+	char buff_out[MAX_BUFFER_LENGTH + 128];
+	char old_room[MAX_NAME_LENGTH + 1];
+
+	strcpy (old_room, cli->room);
+	strcpy (cli->room, room);
+	event_log (EVENT_ROOM, cli->addr.sin_addr.s_addr, cli->uid, cli->name, old_room, cli->room);
+	room_leave (cli->rm);
+	cli->rm = room_join (cli->room);
+	client_changed (cli);
+	sprintf (buff_out, "\r\n\x1B[33mLEAVE %s[%s]\x1B[37m MOVED TO <%s>\r\n\r\n", colors[cli->uid % 4], cli->name, cli->room);
+	send_message_all (buff_out, old_room, cli->name);
+	sprintf (buff_out, "\r\n\x1B[33mJOIN, WELCOME TO \x1B[37m<%s> %s[%s]\x1B[37m\r\n\r\n", cli->room, colors[cli->uid % 4], cli->name);
+	send_message_all (buff_out, cli->room, cli->name);
+	send_history (cli->rm, ROOM_HISTORY_LENGTH, cli);
+}
+
+/* Give a client another name, returns -1 and tells the client if the name is taken */
+int client_rename (client_t *cli, const char *name)
+{
+	char buff_out[MAX_BUFFER_LENGTH + 128];
+	char old_name[MAX_NAME_LENGTH + 1];
+	int x;
+
+	/* Check for existing name */
+	for (x = 0; x < MAX_CLIENTS; x++)
+	{
+		if (clients[x] && !strcicmp (clients[x]->name, name))
+			break;
+	}
+
+	if (x != MAX_CLIENTS || shm_find (name))
+	{
+		send_message_self ("\r\n\x1B[33mNAME ALREADY EXISTS\x1B[37m\r\n\r\n", cli);
+		return -1;
+	}
+
+	/* Change the Name */
+	strcpy (old_name, cli->name);
+	strcpy (cli->name, name);
+	event_log (EVENT_RENAME, cli->addr.sin_addr.s_addr, cli->uid, old_name, cli->room, cli->name);
+	client_changed (cli);
+	fed_changed ();
+	sprintf (buff_out, "\r\n\x1B[33mRENAME\x1B[37m %s TO %s\r\n\r\n", old_name, cli->name);
+	send_message_all (buff_out, cli->room, cli->name);
+	return 0;
 }
 
 /* Handle all communication with the client */
 void *handle_client (void *arg)
 {
 	char buff_out[MAX_BUFFER_LENGTH + 128];
-	char buff_in[MAX_BUFFER_LENGTH];
-	char buff_tmp[MAX_BUFFER_LENGTH + 128];
+	char *buff_in;
+	char *args;
+	char buff_read[MAX_BUFFER_LENGTH];
+	char buff_burst[MAX_HISTORY_MESSAGE_LENGTH];
 	char buff_names[MAX_NAME_LENGTH + 1];
+	char room[MAX_NAME_LENGTH + 1];
 	char buff_banner[1500];
 	int rlen;
+	int len;
+	int burst_len;
+	unsigned long span;
+	char *line;
+	char *next;
 	char *cmp[MAX_COMPARES];
 	int i;
 	char *param;
@@ -282,9 +5741,23 @@ void *handle_client (void *arg)
 	strcpy (cmp[12], "\\away");
 	strcpy (cmp[13], "\\bell");
 	strcpy (cmp[14], "\\mute");
-	/* Add one to the client counter */
-	cli_count++;
+	strcpy (cmp[15], "\\let");
+	strcpy (cmp[16], "\\def");
+	strcpy (cmp[17], "\\history");
+	strcpy (cmp[18], "\\stats");
+	strcpy (cmp[19], "\\admin");
+	strcpy (cmp[20], "\\trace");
+	strcpy (cmp[21], "\\top");
+	strcpy (cmp[22], "\\roomstats");
+	strcpy (cmp[23], "\\filter");
+	strcpy (cmp[24], "\\resume");
 	client_t *cli = (client_t *)arg;
+	rate_init (cli);
+	client_timer_start (cli);
+	memset (cli->lat, 0, sizeof (cli->lat));
+	lat_cli = cli;
+	/* Admin commands need the password, a proxy or tunnel makes every client look local */
+	cli->admin = 0;
 	/* Show Banner */
 	strcpy (buff_banner, "\x1B[33m __      __       .__                                  __             ________               __   /\\       \r\n");
 	strcat (buff_banner, "\x1B[33m/  \\    /  \\ ____ |  |   ____  ____   _____   ____   _/  |_  ____    /  _____/  ____   ____ |  | _)/ ______\r\n");
@@ -299,440 +5772,656 @@ void *handle_client (void *arg)
 	strcat (buff_banner, "\x1B[33m \\___|_  /(____  /\\_/  \\___  >___|  /  \\______  /___|  (____  /__|  __                                     \r\n");
 	strcat (buff_banner, "\x1B[33m       \\/      \\/          \\/     \\/          \\/     \\/     \\/      \\/                                     \x1B[37m\r\n");
 	strcat (buff_banner, "\r\nCreated 2018 by Shane Feek. Tim Smith & Yorick de Wid contributors.\r\n");
-	send_message_self (buff_banner, cli->connfd);
-	send_help (cli->connfd);
-	sprintf (buff_out, "\r\n\r\n\x1B[33mJOIN, WELCOME\x1B[37m %s\r\n\r\n", cli->name);
-	send_message_all (buff_out, cli->room, cli->name);
+	if (cli->resumed)
+	{
+		/* Taken over from a previous process, the session carries on */
+		cli->rm = room_join (cli->room);
+		send_message_self ("\r\n\x1B[33mSERVER UPGRADED\x1B[37m\r\n\r\n", cli);
+	}
+	else
+	{
+		send_message_self (buff_banner, cli);
+		send_help (cli);
+
+		/* Sessions are only saved with a snapshot file */
+		if (*snapshot_path && cli->token)
+		{
+			sprintf (buff_out, "\x1B[33mSESSION\x1B[37m %016llx, after a server restart \\resume %016llx brings your name, room, status and mutes back\r\n",
+				(unsigned long long)cli->token, (unsigned long long)cli->token);
+			send_message_self (buff_out, cli);
+		}
+
+		cli->rm = room_join (cli->room);
+		event_log (EVENT_CONNECT, cli->addr.sin_addr.s_addr, cli->uid, cli->name, cli->room, NULL);
+		sprintf (buff_out, "\r\n\r\n\x1B[33mJOIN, WELCOME\x1B[37m %s\r\n\r\n", cli->name);
+		send_message_all (buff_out, cli->room, cli->name);
+		send_history (cli->rm, ROOM_HISTORY_LENGTH, cli);
+	}
+
+	client_changed (cli);
 
 	/* Receive input from client */
-	while ((rlen = read (cli->connfd, buff_in, MAX_BUFFER_LENGTH - 2)) > 0)
+	while ((rlen = client_read (cli, buff_read, MAX_BUFFER_LENGTH - 2)) > 0)
 	{
-		buff_in[rlen] = '\0'; /* Null Terminate the buffer */
-		strip_newline (buff_in); /* Get rid of newline or carriage return */
+		buff_read[rlen] = '\0'; /* Null Terminate the buffer */
+		atomic_store_explicit (&cli->last_input, atomic_load_explicit (&timer_ticks, memory_order_relaxed), memory_order_relaxed);
+		lat_read = lat_clock ();
+		burst_len = 0;
 
-		if (!strlen (buff_in))
-			continue; /* Ignore empty buffer */
-
-		/* Look for command tokens */
-		if (buff_in[0] == '\\')
+		/* A paste arrives as several lines in one read, handle them in order */
+		for (line = buff_read; line && !quit; line = next)
 		{
-			strtok (buff_in, " ");
+			next = split_line (line, buff_read + rlen); /* Get rid of newline or carriage return */
+			line[text_sanitize (line, strlen (line))] = '\0'; /* No escapes or broken UTF-8 for other terminals */
+			lat_dispatch = lat_clock ();
+			lat_record (cli, LAT_READ, lat_dispatch - lat_read);
+			buff_in = line;
+
+			if (!strlen (buff_in))
+				continue; /* Ignore empty line */
 
-			/* Compare strings until we hit an empty candidate string or get a match */
-			for (i = 0; *cmp[i]; i++)
+			/* Look for command tokens */
+			if (buff_in[0] == '\\')
 			{
-				if (!strcicmp (buff_in, cmp[i]))
+				/* Chat lines that came before the command go out first */
+				send_burst (cli, buff_burst, burst_len);
+				burst_len = 0;
+				span = trace_begin ();
+
+				/* Slice the line in place, the command word is buff_in */
+				args = buff_in;
+				next_word (&args);
+				args = trim (args);
+
+				/* Compare strings until we hit an empty candidate string or get a match */
+				for (i = 0; *cmp[i]; i++)
 				{
-					switch (i) /* Found a match, choose correct case */
+					if (!strcicmp (buff_in, cmp[i]))
 					{
-						case 0: /* Quit */
-							{
-								quit = 1;
-								break;
-							}
-
-						case 1: /* Ping */
-							{
-								send_message_self ("\r\n\x1B[33mPONG\x1B[37m\r\n\r\n", cli->connfd);
-								break;
-							}
-
-						case 2: /* Nick */
-							{
-								param = strtok (NULL, " ");
-
-								if (param)
+						/* Drop the command if its bucket is empty */
+						if (!rate_check (cli, command_class (i)))
+							break;
+
+						switch (i) /* Found a match, choose correct case */
+						{
+							case 0: /* Quit */
+								{
+									quit = 1;
+									break;
+								}
+
+							case 1: /* Ping */
+								{
+									send_message_self ("\r\n\x1B[33mPONG\x1B[37m\r\n\r\n", cli);
+									break;
+								}
+
+							case 2: /* Nick */
+								{
+									param = next_word (&args);
+
+									if (param)
+									{
+										/* Chop name if too long */
+										strncpy (buff_names, param, MAX_NAME_LENGTH);
+										buff_names[MAX_NAME_LENGTH] = '\0';
+
+										client_rename (cli, buff_names);
+									}
+									else
+									{
+										send_message_self ("\r\n\x1B[33mNAME CANNOT BE NULL\x1B[37m\r\n\r\n", cli);
+									}
+
+									break;
+								}
+
+							case 3: /* Private */
+								{
+									param = next_word (&args);
+
+									if (param)
+									{
+										/* Chop name if too long */
+										strncpy (buff_names, param, MAX_NAME_LENGTH);
+										buff_names[MAX_NAME_LENGTH] = '\0';
+										/* Look up user ID, the user may also be on another node */
+										int uid = client_find (buff_names);
+
+										/* Check if a valid user was chosen */
+										if (uid == -1 && !shm_find (buff_names) && !fed_has_nick (buff_names))
+										{
+											sprintf (buff_out, "\r\n\x1B[33mUNKNOWN USER\x1B[37m - [%s]\r\n\r\n", buff_names);
+											send_message_self (buff_out, cli);
+											break;
+										}
+
+										/* Send the PM */
+										if (*args)
+										{
+											struct iovec parts[4] = {{"\x1B[31m[PM]", 9}, {cli->prefix, cli->prefix_len}, {args, strlen (args)}, {"\r\n", 2}};
+											iov_gather (buff_out, parts, 4);
+
+											if (uid != -1)
+												send_message_client (buff_out, cli->name, uid);
+											else if (shm_direct (buff_out, buff_names, cli->name) < 0)
+												fed_direct (buff_out, buff_names, cli->name);
+
+											send_message_self ("\r\n\x1B[33mPM SENT\x1B[37m\r\n\r\n", cli);
+										}
+										else
+										{
+											send_message_self ("\r\n\x1B[33mMESSAGE CANNOT BE NULL\x1B[37m\r\n\r\n", cli);
+										}
+									}
+									else
+									{
+										send_message_self ("\r\n\x1B[33mUSER CANNOT BE NULL\x1B[37m\r\n\r\n", cli);
+									}
+
+									break;
+								}
+
+							case 4: /* Who */
+								{
+									param = next_word (&args);
+
+									if (param)
+									{
+										char *page = next_word (&args);
+										send_clients_page (cli, param, page ? atoi (page) : 1);
+										send_message_self ("\r\n", cli);
+										break;
+									}
+
+									sprintf (buff_out, "\r\n\x1B[33mCLIENTS\x1B[37m %d\r\n", cli_count + shm_count ());
+									send_message_self (buff_out, cli);
+									send_active_clients (cli);
+									shm_send_clients (cli);
+									send_message_self ("\r\n", cli);
+									break;
+								}
+
+							case 5: /* Me */
+								{
+									if (*args && !spam_check (cli, args))
+										break;
+
+									if (*args)
+									{
+										filter_apply (args);
+										sprintf (buff_out, "\007%s*** %s %.*s ***\x1B[37m\r\n", colors[cli->uid % 4], cli->name, MAX_SHORT_MESSAGE_LENGTH, args);
+										send_message_all (buff_out, cli->room, cli->name);
+										record_message (cli, buff_out);
+									}
+									else
+									{
+										send_message_self ("\r\n\x1B[33mMESSAGE CANNOT BE NULL\x1B[37m\r\n", cli);
+									}
+
+									break;
+								}
+
+							case 6: /* Help */
+								{
+									send_help (cli);
+									break;
+								}
+
+							case 7: /* Room */
+								{
+									param = next_word (&args);
+
+									if (param)
+									{
+										/* Chop name if too long */
+										strncpy (buff_names, param, MAX_NAME_LENGTH);
+										buff_names[MAX_NAME_LENGTH] = '\0';
+										room_move (cli, buff_names);
+									}
+									else
+									{
+										/* Local members are counted by the room itself */
+										int count = cli->rm ? cli->rm->members : 0;
+
+										/* Show clients in the room */
+										sprintf (buff_out, "\r\n\x1B[33mROOM NAME\x1B[37m <%s> | \x1B[33mCLIENTS\x1B[37m %d\r\n", cli->room, count);
+										send_message_self (buff_out, cli);
+										send_active_clients_room (cli, cli->room);
+										send_message_self ("\r\n", cli);
+									}
+
+									break;
+								}
+
+							case 8: /* Time */
+								{
+									time_t rawtime;
+									struct tm *timeinfo;
+									time (&rawtime);
+									timeinfo = localtime (&rawtime);
+									sprintf (buff_out, "\r\n\x1B[33mTIME\x1B[37m  %s\r\n", asctime (timeinfo));
+									send_message_self (buff_out, cli);
+									break;
+								}
+
+							case 9: /* Math */
+								{
+									if (*args)
+									{
+										sprintf (buff_out, "\r\n\x1B[33mMATH\x1B[37m  %s = %g\r\n\r\n", args, math_eval (math_env (cli), args));
+										send_message_self (buff_out, cli);
+									}
+									else
+									{
+										send_message_self ("\r\n\x1B[33mMATH MISSING EXPRESSION\x1B[37m\r\n\r\n", cli);
+									}
+
+									break;
+								}
+
+							case 10: /* Echo */
 								{
-									/* Chop name if too long */
-									strncpy (buff_names, param, MAX_NAME_LENGTH);
-									buff_names[MAX_NAME_LENGTH] = '\0';
+									param = next_word (&args);
 
-									/* Check for existing name */
-									for (x = 0; x < MAX_CLIENTS; x++)
+									if (param)
 									{
-										if (clients[x])
-										{
-											if (!strcicmp (clients[x]->name, buff_names))
-											{
-												send_message_self ("\r\n\x1B[33mNAME ALREADY EXISTS\x1B[37m\r\n\r\n", cli->connfd);
-												break;
-											}
-										}
+										if (!strcicmp (param, "on"))
+											cli->echo = 1;
+										else
+											cli->echo = 0;
 									}
 
-									/* Stop if name already used */
-									if (x != MAX_CLIENTS)
-										break;
-
-									/* Change the Name */
-									char *old_name = strdup (cli->name);
-									strcpy (cli->name, buff_names);
-									sprintf (buff_out, "\r\n\x1B[33mRENAME\x1B[37m %s TO %s\r\n\r\n", old_name, cli->name);
-									free (old_name);
-									send_message_all (buff_out, cli->room, cli->name);
-								}
-								else
-								{
-									send_message_self ("\r\n\x1B[33mNAME CANNOT BE NULL\x1B[37m\r\n\r\n", cli->connfd);
+									break;
 								}
 
-								break;
-							}
+							case 11: /* Roll Dice */
+								{
+									char roll_out[50];
+									int r = rand();
+									param = next_word (&args);
 
-						case 3: /* Private */
-							{
-								param = strtok (NULL, " ");
+									if (param)
+									{
+										int sides = atoi (param);
 
-								if (param)
-								{
-									/* Chop name if too long */
-									strncpy (buff_names, param, MAX_NAME_LENGTH);
-									buff_names[MAX_NAME_LENGTH] = '\0';
-									/* Look up user ID */
-									int uid = -1;
-									int x;
+										if (sides > 0)
+											sprintf (roll_out, "%d", (r % sides) + 1);
+										else
+											sprintf (roll_out, "UNDEFINED");
 
-									for (x = 0; x < MAX_CLIENTS; x++)
+										sprintf (buff_out, "\r\n\x1B[33mDICE D%d\x1B[37m%s %s", sides, colors[cli->uid % 4], cli->name);
+										strcat (buff_out, " rolled a ");
+										strcat (buff_out, roll_out);
+										strcat (buff_out, "\x1B[37m\r\n\r\n");
+										send_message_all (buff_out, cli->room, cli->name);
+										record_message (cli, buff_out);
+									}
+									else
 									{
-										if (clients[x])
-										{
-											if (!strcicmp (clients[x]->name, buff_names))
-												uid = clients[x]->uid;
-										}
+										send_message_self ("\r\n\x1B[33mNUMBER CANNOT BE NULL\x1B[37m\r\n", cli);
 									}
 
-									/* Check if a valid user was chosen */
-									if (uid == -1)
+									break;
+								}
+
+							case 12: /* Away */
+								{
+									if (*args)
 									{
-										sprintf (buff_out, "\r\n\x1B[33mUNKNOWN USER\x1B[37m - [%s]\r\n\r\n", buff_names);
-										send_message_self (buff_out, cli->connfd);
-										break;
+										snprintf (cli->status, sizeof (cli->status), "%s", args);
+										sprintf (buff_out, "\r\n\x1B[33mAWAY %s[%s] %s\x1B[37m\r\n\r\n", colors[cli->uid % 4], cli->name, cli->status);
+										send_message_all (buff_out, cli->room, cli->name);
+										client_changed (cli);
 									}
+									else
+									{
+										sprintf (buff_out, "\r\n\x1B[33mAWAY %s[%s] IS AVAILABLE\x1B[37m\r\n\r\n", colors[cli->uid % 4], cli->name);
+										send_message_all (buff_out, cli->room, cli->name);
+										strcpy (cli->status, "AVAILABLE");
+										client_changed (cli);
+									}
+
+									break;
+								}
 
-									/* Send the PM */
-									param = strtok (NULL, " ");
+							case 13: /* Bell */
+								{
+									param = next_word (&args);
 
 									if (param)
 									{
-										sprintf (buff_out, "\x1B[31m[PM]%s<%s>[%s]\x1B[37m", colors[cli->uid % 4], cli->room, cli->name);
+										/* Chop name if too long */
+										strncpy (buff_names, param, MAX_NAME_LENGTH);
+										buff_names[MAX_NAME_LENGTH] = '\0';
+										/* Look up user ID, the user may also be on another node */
+										int uid = client_find (buff_names);
 
-										while (param != NULL)
+										/* Check if a valid user was chosen */
+										if (uid == -1 && !shm_find (buff_names) && !fed_has_nick (buff_names))
 										{
-											strcat (buff_out, " ");
-											strcat (buff_out, param);
-											param = strtok (NULL, " ");
+											sprintf (buff_out, "\r\n\x1B[33mUNKNOWN USER\x1B[37m - [%s]\r\n\r\n", buff_names);
+											send_message_self (buff_out, cli);
+											break;
 										}
 
-										strcat (buff_out, "\r\n");
-										send_message_client (buff_out, cli->name, uid);
-										send_message_self ("\r\n\x1B[33mPM SENT\x1B[37m\r\n\r\n", cli->connfd);
+										/* Send the bell */
+										sprintf (buff_out, "\007\r\n\x1B[33mBELL FROM %s<%s>[%s]\x1B[37m\r\n\r\n", colors[cli->uid % 4], cli->room, cli->name);
+
+										if (uid != -1)
+											send_message_client (buff_out, cli->name, uid);
+										else if (shm_direct (buff_out, buff_names, cli->name) < 0)
+											fed_direct (buff_out, buff_names, cli->name);
+
+										send_message_self ("\r\n\x1B[33mBELL SENT\x1B[37m\r\n\r\n", cli);
 									}
 									else
 									{
-										send_message_self ("\r\n\x1B[33mMESSAGE CANNOT BE NULL\x1B[37m\r\n\r\n", cli->connfd);
+										send_message_self ("\r\n\x1B[33mUSER CANNOT BE NULL\x1B[37m\r\n\r\n", cli);
 									}
+
+									break;
 								}
-								else
+
+							case 14: /* Mute */
 								{
-									send_message_self ("\r\n\x1B[33mUSER CANNOT BE NULL\x1B[37m\r\n\r\n", cli->connfd);
-								}
+									size_t used = 0;
 
-								break;
-							}
+									/* Each name is stored as |name| */
+									while ((param = next_word (&args)) && used < sizeof (cli->mute) - 1)
+										used += snprintf (cli->mute + used, sizeof (cli->mute) - used, "|%s|", param);
 
-						case 4: /* Who */
-							{
-								sprintf (buff_out, "\r\n\x1B[33mCLIENTS\x1B[37m %d\r\n", cli_count);
-								send_message_self (buff_out, cli->connfd);
-								send_active_clients (cli->connfd);
-								send_message_self ("\r\n", cli->connfd);
-								break;
-							}
+									cli->mute[used < sizeof (cli->mute) ? used : sizeof (cli->mute) - 1] = '\0';
 
-						case 5: /* Me */
-							{
-								param = strtok (NULL, " ");
+									send_message_self ("\r\n\x1B[33mMUTE UPDATED\x1B[37m\r\n\r\n", cli);
+									break;
+								}
 
-								if (param)
+							case 15: /* Let */
 								{
-									buff_tmp[0] = '\0';
+									param = (*args ? args : NULL);
+									char *expr = param ? strchr (param, '=') : NULL;
 
-									while (param != NULL)
+									if (expr)
 									{
-										strcat (buff_tmp, " ");
-										strcat (buff_tmp, param);
-										param = strtok (NULL, " ");
+										const char *err;
+										int updated = 0;
+										*expr++ = '\0';
+										param = trim (param);
+										expr = trim (expr);
+										err = math_let (math_env (cli), param, expr, &updated);
+
+										if (err)
+											sprintf (buff_out, "\r\n\x1B[33m%s\x1B[37m - [%.*s]\r\n\r\n", err, MAX_NAME_LENGTH, param);
+										else
+											sprintf (buff_out, "\r\n\x1B[33mLET\x1B[37m  %s = %g (%d UPDATED)\r\n\r\n", param, math_find_var (cli->math, param)->value, updated);
+
+										send_message_self (buff_out, cli);
+									}
+									else
+									{
+										send_message_self ("\r\n\x1B[33mMATH VARIABLES\x1B[37m\r\n", cli);
+										send_math_env (math_env (cli), cli);
+										send_message_self ("\r\n", cli);
 									}
 
-									buff_tmp[MAX_SHORT_MESSAGE_LENGTH + 1] = '\0';
-									sprintf (buff_out, "\007%s*** %s %s ***\x1B[37m\r\n", colors[cli->uid % 4], cli->name, buff_tmp);
-									send_message_all (buff_out, cli->room, cli->name);
+									break;
 								}
-								else
+
+							case 16: /* Def */
 								{
-									send_message_self ("\r\n\x1B[33mMESSAGE CANNOT BE NULL\x1B[37m\r\n", cli->connfd);
-								}
+									param = (*args ? args : NULL);
+									char *lparen = param ? strchr (param, '(') : NULL;
+									char *rparen = lparen ? strchr (lparen, ')') : NULL;
+									char *expr = rparen ? strchr (rparen, '=') : NULL;
 
-								break;
-							}
+									if (expr)
+									{
+										const char *err;
+										int updated = 0;
+										*lparen++ = '\0';
+										*rparen = '\0';
+										expr++;
+										param = trim (param);
+										lparen = trim (lparen);
+										expr = trim (expr);
+										err = math_def (math_env (cli), param, lparen, expr, &updated);
 
-						case 6: /* Help */
-							{
-								send_help (cli->connfd);
-								break;
-							}
+										if (err)
+											sprintf (buff_out, "\r\n\x1B[33m%s\x1B[37m - [%.*s]\r\n\r\n", err, MAX_NAME_LENGTH, param);
+										else
+											sprintf (buff_out, "\r\n\x1B[33mDEF\x1B[37m  %s(%s) = %s (%d UPDATED)\r\n\r\n", param, lparen, expr, updated);
 
-						case 7: /* Room */
-							{
-								param = strtok (NULL, " ");
+										send_message_self (buff_out, cli);
+									}
+									else
+									{
+										send_message_self ("\r\n\x1B[33mDEF MISSING FUNCTION\x1B[37m\r\n\r\n", cli);
+									}
 
-								if (param)
-								{
-									/* Chop name if too long */
-									strncpy (buff_names, param, MAX_NAME_LENGTH);
-									buff_names[MAX_NAME_LENGTH] = '\0';
-									/* Change the room */
-									char *old_room = strdup (cli->room);
-									strcpy (cli->room, buff_names);
-									sprintf (buff_out, "\r\n\x1B[33mLEAVE %s[%s]\x1B[37m MOVED TO <%s>\r\n\r\n", colors[cli->uid % 4], cli->name, cli->room);
-									send_message_all (buff_out, old_room, cli->name);
-									sprintf (buff_out, "\r\n\x1B[33mJOIN, WELCOME TO \x1B[37m<%s> %s[%s]\x1B[37m\r\n\r\n", cli->room, colors[cli->uid % 4], cli->name);
-									send_message_all (buff_out, cli->room, cli->name);
-									free (old_room);
+									break;
 								}
-								else
+
+							case 17: /* History */
 								{
-									int count = 0;
+									int count = ROOM_HISTORY_LENGTH;
+									param = next_word (&args);
 
-									/* Count clients in a room */
-									for (x = 0; x < MAX_CLIENTS; x++)
-									{
-										if (clients[x])
-										{
-											if (!strcicmp (clients[x]->room, cli->room))
-												count++;
-										}
-									}
+									if (param)
+										count = atoi (param);
+
+									if (count <= 0 || !send_history (cli->rm, count, cli))
+										send_message_self ("\r\n\x1B[33mNO HISTORY\x1B[37m\r\n\r\n", cli);
 
-									/* Show clients in the room */
-									sprintf (buff_out, "\r\n\x1B[33mROOM NAME\x1B[37m <%s> | \x1B[33mCLIENTS\x1B[37m %d\r\n", cli->room, count);
-									send_message_self (buff_out, cli->connfd);
-									send_active_clients_room (cli->connfd, cli->room);
-									send_message_self ("\r\n", cli->connfd);
+									break;
 								}
 
-								break;
-							}
-
-						case 8: /* Time */
-							{
-								time_t rawtime;
-								struct tm *timeinfo;
-								time (&rawtime);
-								timeinfo = localtime (&rawtime);
-								sprintf (buff_out, "\r\n\x1B[33mTIME\x1B[37m  %s\r\n", asctime (timeinfo));
-								send_message_self (buff_out, cli->connfd);
-								break;
-							}
-
-						case 9: /* Math */
-							{
-								param = strtok (NULL, " ");
-
-								if (param)
+							case 18: /* Stats */
 								{
-									buff_tmp[0] = 0;
-
-									while (param != NULL)
+									if (!cli->admin)
 									{
-										strcat (buff_tmp, " ");
-										strcat (buff_tmp, param);
-										param = strtok (NULL, " ");
+										send_message_self ("\r\n\x1B[33mADMIN ONLY\x1B[37m\r\n\r\n", cli);
+										break;
 									}
 
-									sprintf (buff_out, "\r\n\x1B[33mMATH\x1B[37m  %s = %g\r\n\r\n", buff_tmp, te_interp (buff_tmp, 0));
-									send_message_self (buff_out, cli->connfd);
+									send_message_self ("\r\n\x1B[33mSERVER STATS\x1B[37m\r\n", cli);
+									send_rate_stats (cli);
+									send_latency_stats (cli);
+									send_message_self ("\r\n", cli);
+									break;
 								}
-								else
+
+							case 19: /* Admin */
 								{
-									send_message_self ("\r\n\x1B[33mMATH MISSING EXPRESSION\x1B[37m\r\n\r\n", cli->connfd);
-								}
+									param = next_word (&args);
 
-								break;
-							}
+									if (param && admin_password && secret_equal (param, admin_password))
+									{
+										cli->admin = 1;
+										send_message_self ("\r\n\x1B[33mADMIN GRANTED\x1B[37m\r\n\r\n", cli);
+									}
+									else
+									{
+										send_message_self ("\r\n\x1B[33mADMIN DENIED\x1B[37m\r\n\r\n", cli);
+									}
 
-						case 10: /* Echo */
-							{
-								param = strtok (NULL, " ");
+									break;
+								}
 
-								if (param)
+							case 20: /* Trace */
 								{
-									if (!strcicmp (param, "on"))
-										cli->echo = 1;
-									else
-										cli->echo = 0;
-								}
+									long count;
 
-								break;
-							}
+									if (!cli->admin)
+									{
+										send_message_self ("\r\n\x1B[33mADMIN ONLY\x1B[37m\r\n\r\n", cli);
+										break;
+									}
 
-						case 11: /* Roll Dice */
-							{
-								char roll_out[50];
-								int r = rand();
-								param = strtok (NULL, " ");
+									if (!trace_on)
+									{
+										send_message_self ("\r\n\x1B[33mTRACING IS OFF\x1B[37m\r\n\r\n", cli);
+										break;
+									}
 
-								if (param)
-								{
-									int sides = atoi (param);
+									count = trace_dump (trace_path);
 
-									if (sides > 0)
-										sprintf (roll_out, "%d", (r % sides) + 1);
+									if (count < 0)
+										sprintf (buff_out, "\r\n\x1B[33mTRACE WRITE FAILED\x1B[37m %s\r\n\r\n", strerror (errno));
 									else
-										sprintf (roll_out, "UNDEFINED");
+										sprintf (buff_out, "\r\n\x1B[33mTRACE\x1B[37m %ld events written to %.*s\r\n\r\n", count, MAX_SHORT_MESSAGE_LENGTH, trace_path);
 
-									sprintf (buff_out, "\r\n\x1B[33mDICE D%d\x1B[37m%s %s", sides, colors[cli->uid % 4], cli->name);
-									strcat (buff_out, " rolled a ");
-									strcat (buff_out, roll_out);
-									strcat (buff_out, "\x1B[37m\r\n\r\n");
-									send_message_all (buff_out, cli->room, cli->name);
-								}
-								else
-								{
-									send_message_self ("\r\n\x1B[33mNUMBER CANNOT BE NULL\x1B[37m\r\n", cli->connfd);
+									send_message_self (buff_out, cli);
+									break;
 								}
 
-								break;
-							}
-
-						case 12: /* Away */
-							{
-								param = strtok (NULL, " ");
-
-								if (param)
+							case 21: /* Top */
 								{
-									buff_tmp[0] = '\0';
+									if (!cli->admin)
+									{
+										send_message_self ("\r\n\x1B[33mADMIN ONLY\x1B[37m\r\n\r\n", cli);
+										break;
+									}
 
-									while (param != NULL)
+									param = next_word (&args);
+
+									if (param && !strcicmp (param, "reset"))
+									{
+										send_top (cli, 1);
+										send_message_self ("\r\n\x1B[33mTOP RESET\x1B[37m\r\n\r\n", cli);
+									}
+									else
 									{
-										strcat (buff_tmp, " ");
-										strcat (buff_tmp, param);
-										param = strtok (NULL, " ");
+										send_message_self ("\r\n", cli);
+										send_top (cli, 0);
+										send_message_self ("\r\n", cli);
 									}
 
-									buff_tmp[MAX_SHORT_MESSAGE_LENGTH + 1] = '\0';
-									sprintf (buff_out, "\r\n\x1B[33mAWAY %s[%s] %s\x1B[37m\r\n\r\n", colors[cli->uid % 4], cli->name, buff_tmp);
-									send_message_all (buff_out, cli->room, cli->name);
-									strcpy (cli->status, buff_tmp);
+									break;
 								}
-								else
+
+							case 22: /* Room Stats */
 								{
-									sprintf (buff_out, "\r\n\x1B[33mAWAY %s[%s] IS AVAILABLE\x1B[37m\r\n\r\n", colors[cli->uid % 4], cli->name);
-									send_message_all (buff_out, cli->room, cli->name);
-									strcpy (cli->status, "AVAILABLE");
+									param = next_word (&args);
+									send_message_self ("\r\n\x1B[33mROOM STATS\x1B[37m\r\n", cli);
+									send_room_stats (cli, param);
+									send_message_self ("\r\n", cli);
+									break;
 								}
 
-								break;
-							}
-
-						case 13: /* Bell */
-							{
-								param = strtok (NULL, " ");
-
-								if (param)
+							case 23: /* Filter */
 								{
-									/* Chop name if too long */
-									strncpy (buff_names, param, MAX_NAME_LENGTH);
-									buff_names[MAX_NAME_LENGTH] = '\0';
-									/* Look up user ID */
-									int uid = -1;
-									int x;
-
-									for (x = 0; x < MAX_CLIENTS; x++)
+									if (!cli->admin)
 									{
-										if (clients[x])
-										{
-											if (!strcicmp (clients[x]->name, buff_names))
-												uid = clients[x]->uid;
-										}
+										send_message_self ("\r\n\x1B[33mADMIN ONLY\x1B[37m\r\n\r\n", cli);
+										break;
 									}
 
-									/* Check if a valid user was chosen */
-									if (uid == -1)
+									param = next_word (&args);
+
+									if (!param || strcicmp (param, "reload"))
+										send_filter (cli);
+									else if (!filter_path)
+										send_message_self ("\r\n\x1B[33mFILTER IS OFF\x1B[37m\r\n\r\n", cli);
+									else if ((x = filter_reload ()) < 0)
 									{
-										sprintf (buff_out, "\r\n\x1B[33mUNKNOWN USER\x1B[37m - [%s]\r\n\r\n", buff_names);
-										send_message_self (buff_out, cli->connfd);
-										break;
+										sprintf (buff_out, "\r\n\x1B[33mFILTER RELOAD FAILED\x1B[37m %s\r\n\r\n", strerror (errno));
+										send_message_self (buff_out, cli);
+									}
+									else
+									{
+										sprintf (buff_out, "\r\n\x1B[33mFILTER RELOADED\x1B[37m %d patterns\r\n\r\n", x);
+										send_message_self (buff_out, cli);
 									}
 
-									/* Send the bell */
-									sprintf (buff_out, "\007\r\n\x1B[33mBELL FROM %s<%s>[%s]\x1B[37m\r\n\r\n", colors[cli->uid % 4], cli->room, cli->name);
-									send_message_client (buff_out, cli->name, uid);
-									send_message_self ("\r\n\x1B[33mBELL SENT\x1B[37m\r\n\r\n", cli->connfd);
-								}
-								else
-								{
-									send_message_self ("\r\n\x1B[33mUSER CANNOT BE NULL\x1B[37m\r\n\r\n", cli->connfd);
+									break;
 								}
 
-								break;
-							}
-
-						case 14: /* Mute */
-							{
-								param = strtok (NULL, " ");
-
-								if (param)
+							case 24: /* Resume */
 								{
-									buff_tmp[0] = '\0';
+									param = next_word (&args);
 
-									while (param != NULL)
+									if (!param || !snapshot_restore (cli, strtoull (param, NULL, 16), buff_names, room))
 									{
-										strcat (buff_tmp, "|");
-										strcat (buff_tmp, param);
-										strcat (buff_tmp, "|");
-										param = strtok (NULL, " ");
+										send_message_self ("\r\n\x1B[33mNO SUCH SESSION\x1B[37m\r\n\r\n", cli);
+										break;
 									}
 
-									buff_tmp[MAX_SHORT_MESSAGE_LENGTH + 1] = '\0';
-									strcpy (cli->mute, buff_tmp);
-								}
-								else
-								{
-									strcpy (cli->mute, "");
+									/* Status and mutes are back, the name only if nobody took it meanwhile */
+									client_changed (cli);
+
+									if (strcmp (buff_names, cli->name))
+										client_rename (cli, buff_names);
+
+									if (strcmp (room, cli->room))
+										room_move (cli, room);
+
+									sprintf (buff_out, "\r\n\x1B[33mSESSION RESTORED\x1B[37m %s<%s>[%s]\x1B[37m\r\n\r\n", colors[cli->uid % 4], cli->room, cli->name);
+									send_message_self (buff_out, cli);
+									break;
 								}
+						}
 
-								send_message_self ("\r\n\x1B[33mMUTE UPDATED\x1B[37m\r\n\r\n", cli->connfd);
-								break;
-							}
+						break;
 					}
+				}
+
+				/* Look for bad command */
+				if (!*cmp[i])
+					send_message_self ("\r\n\x1B[33mUNKNOWN COMMAND\x1B[37m\r\n\r\n", cli);
 
+				trace_end ("command", span);
+
+				/* Leave the loop if user chooses to quit */
+				if (quit)
 					break;
-				}
 			}
+			else
+			{
+				/* No Command, Send as message */
+				if (!spam_check (cli, buff_in))
+					continue;
 
-			/* Look for bad command */
-			if (i > 14)
-				send_message_self ("\r\n\x1B[33mUNKNOWN COMMAND\x1B[37m\r\n\r\n", cli->connfd);
+				span = trace_begin ();
+				filter_apply (buff_in);
+				/* The rendered prefix is kept by the client, no formatting per line */
+				struct iovec parts[3] = {{cli->prefix, cli->prefix_len}, {buff_in, strlen (buff_in)}, {"\r\n", 2}};
+				len = parts[0].iov_len + parts[1].iov_len + parts[2].iov_len;
 
-			/* Leave the loop if user chooses to quit */
-			if (quit)
-				break;
-		}
-		else
-		{
-			/* No Command, Send as message */
-			sprintf (buff_out, "%s<%s>[%s]\x1B[37m %s\r\n", colors[cli->uid % 4], cli->room, cli->name, buff_in);
+				/* Gather the lines of a burst, one broadcast per recipient */
+				if (burst_len + len >= MAX_HISTORY_MESSAGE_LENGTH)
+				{
+					send_burst (cli, buff_burst, burst_len);
+					burst_len = 0;
+				}
 
-			if (cli->echo)
-				send_message_all (buff_out, cli->room, cli->name);
-			else
-				send_message_except_self (buff_out, cli->room, cli->name, cli->uid);
+				/* A burst takes a token per buffer it fills, so a paste is not cut to the bucket size in lines */
+				if (!burst_len && !rate_check (cli, RATE_MESSAGE))
+				{
+					trace_end ("message", span);
+					continue;
+				}
+
+				iov_gather (buff_burst + burst_len, parts, 3);
+				record_message (cli, buff_burst + burst_len);
+				burst_len += len;
+				trace_end ("message", span);
+			}
 		}
+
+		send_burst (cli, buff_burst, burst_len);
+		lat_dispatch = 0;
+
+		/* Leave the loop if user chooses to quit */
+		if (quit)
+			break;
 	}
 
-	/* Close connection */
-	close (cli->connfd);
+	event_log (EVENT_DISCONNECT, cli->addr.sin_addr.s_addr, cli->uid, cli->name, cli->room, NULL);
+
+	/* Close connection, the timer must not touch the descriptor once it is reused */
+	wheel_del (&cli->timer);
+	client_close (cli);
 	sprintf (buff_out, "\r\n\x1B[33mLEAVE, BYE\x1B[37m %s\r\n\r\n", cli->name);
 	send_message_all (buff_out, cli->room, cli->name);
 
@@ -744,9 +6433,19 @@ void *handle_client (void *arg)
 	}
 
 	/* Delete client from queue and yield thread */
+	room_leave (cli->rm);
+	shm_withdraw (cli->uid);
 	queue_delete (cli->uid);
+	admit_release (cli->addr.sin_addr.s_addr);
+	math_env_free (cli->math);
+
+	/* Out of the queue, wait for the flusher to let go */
+	while (atomic_load_explicit (&cli->refs, memory_order_acquire))
+		usleep (1000);
+
+	pthread_mutex_destroy (&cli->out_mutex);
+	free (cli->out);
 	free (cli);
-	cli_count--;
 	pthread_detach (pthread_self());
 	return NULL;
 }
@@ -754,41 +6453,283 @@ void *handle_client (void *arg)
 /* Chat Server Main */
 int main (int argc, char *argv[])
 {
-	int listenfd = 0, connfd = 0;
+	int connfd = 0;
 	struct sockaddr_in serv_addr;
 	struct sockaddr_in cli_addr;
-	pthread_t tid;
-	/* Socket settings */
-	listenfd = socket (AF_INET, SOCK_STREAM, 0);
-	serv_addr.sin_family = AF_INET;
-	serv_addr.sin_addr.s_addr = htonl (INADDR_ANY);
-	serv_addr.sin_port = htons (6969);
+	char *log_opt = NULL, *snapshot_opt = NULL, *handoff_opt = NULL, *shm_opt = NULL, *event_path = NULL;
+	struct sockaddr_in peers[MAX_PEERS];
+	struct sockaddr_in fed_addr;
+	char fed_opt[80];
+	int port = 6969, fed_port = 0, peer_count = 0, uring_opt = 0;
+	int opt, i, uid;
+	history_init ();
+
+	/* Command line options */
+	while ((opt = getopt (argc, argv, "p:l:s:H:f:k:L:m:b:c:r:A:t:a:T:e:w:d:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'p': /* Chat port */
+				port = atoi (optarg);
+				break;
+
+			case 'l': /* Room log directory */
+				log_opt = optarg;
+				break;
+
+			case 's': /* State snapshot file */
+				snapshot_opt = optarg;
+				break;
+
+			case 'H': /* Hot upgrade socket */
+				handoff_opt = optarg;
+				break;
+
+			case 'f': /* Federation address, loopback unless a host is given */
+				if (strchr (optarg, ':'))
+					snprintf (fed_opt, sizeof (fed_opt), "%s", optarg);
+				else
+					snprintf (fed_opt, sizeof (fed_opt), "127.0.0.1:%s", optarg);
+
+				if (fed_parse_addr (fed_opt, &fed_addr) < 0)
+				{
+					fprintf (stderr, "Bad federation address %s\n", optarg);
+					return 1;
+				}
+
+				fed_port = 1;
+				break;
+
+			case 'k': /* Federation secret */
+				fed_secret = optarg;
+				break;
+
+			case 'L': /* Federation peer */
+				if (peer_count == MAX_PEERS || fed_parse_addr (optarg, &peers[peer_count]) < 0)
+				{
+					fprintf (stderr, "Bad peer %s\n", optarg);
+					return 1;
+				}
+
+				peer_count++;
+				break;
+
+			case 'm': /* Shared registry name */
+				shm_opt = optarg;
+				break;
+
+			case 'c': /* Output coalescing window */
+				coalesce_window = atoi (optarg);
+				break;
+
+			case 'b': /* I/O backend */
+				if (!strcmp (optarg, "uring"))
+					uring_opt = 1;
+				else if (strcmp (optarg, "write"))
+				{
+					fprintf (stderr, "Unknown backend %s\n", optarg);
+					return 1;
+				}
+
+				break;
+
+			case 'r': /* Input rate limit */
+				if (rate_parse (optarg) < 0)
+				{
+					fprintf (stderr, "Bad rate limit %s\n", optarg);
+					return 1;
+				}
+
+				break;
+
+			case 'A': /* Admission control */
+				if (admit_parse (optarg) < 0)
+				{
+					fprintf (stderr, "Bad admission limit %s\n", optarg);
+					return 1;
+				}
+
+				break;
+
+			case 't': /* Idle timeout, keepalive and write stall */
+				if (timer_parse (optarg) < 0)
+				{
+					fprintf (stderr, "Bad timeouts %s\n", optarg);
+					return 1;
+				}
+
+				break;
+
+			case 'a': /* Admin password */
+				admin_password = optarg;
+				break;
+
+			case 'T': /* Trace file */
+				trace_path = optarg;
+				trace_on = 1;
+				break;
+
+			case 'e': /* Event log */
+				event_path = optarg;
+				break;
+
+			case 'w': /* Word filter */
+				filter_path = optarg;
+				break;
+
+			case 'd': /* Duplicate detection */
+				if (spam_parse (optarg) < 0)
+				{
+					fprintf (stderr, "Bad duplicate limits %s\n", optarg);
+					return 1;
+				}
+
+				break;
+
+			default:
+				fprintf (stderr, "Usage: %s [-p port] [-l log_dir] [-s snapshot_file] [-H upgrade_socket] [-f [host:]federation_port] [-k federation_secret] [-L peer_host:port]... [-m shared_registry] [-b write|uring] [-c coalesce_usec] [-r msg|pm|cmd=rate/burst]... [-A conns/rate/burst] [-t idle/keepalive/stall] [-a admin_password] [-T trace_file] [-e event_log] [-w filter_file] [-d sender/global/seconds]\n", argv[0]);
+				return 1;
+		}
+	}
+
 	/* Ignore pipe signals */
 	signal (SIGPIPE, SIG_IGN);
 
-	/* Bind */
-	if (bind (listenfd, (struct sockaddr *)&serv_addr, sizeof (serv_addr)) < 0)
+	if (trace_on)
+		pthread_key_create (&trace_key, trace_release);
+
+	if (coalesce_window)
+	{
+		pthread_t tid;
+		pthread_create (&tid, NULL, &coalesce_flusher, NULL);
+		pthread_detach (tid);
+	}
+
+	/* Wheel before handoff_take, resumed clients arm their timers straight away */
+	if (idle_timeout || keepalive_interval || stall_timeout)
+	{
+		pthread_t tid;
+		wheel_init ();
+		pthread_create (&tid, NULL, &wheel_runner, NULL);
+		pthread_detach (tid);
+	}
+
+	if (filter_path && filter_reload () < 0)
+	{
+		perror ("\x1B[34mWord filter open failed\x1B[37m");
+		return 1;
+	}
+
+	if (uring_opt && uring_init () < 0)
+	{
+		perror ("\x1B[34mio_uring setup failed\x1B[37m");
+		return 1;
+	}
+
+	if (event_path && event_init (event_path) < 0)
+	{
+		perror ("\x1B[34mEvent log open failed\x1B[37m");
+		return 1;
+	}
+
+	/* Take over from a running server first, it flushes the room log before handing over */
+	if (handoff_opt)
+		listen_fd = handoff_take (handoff_opt);
+
+	if (log_opt && log_init (log_opt) < 0)
+	{
+		perror ("\x1B[34mRoom log open failed\x1B[37m");
+		return 1;
+	}
+
+	if (snapshot_opt)
+		snapshot_init (snapshot_opt);
+
+	if (shm_opt && shm_init (shm_opt) < 0)
+	{
+		perror ("\x1B[34mShared registry open failed\x1B[37m");
+		return 1;
+	}
+
+	if (listen_fd < 0)
+	{
+		/* Socket settings */
+		listen_fd = socket (AF_INET, SOCK_STREAM, 0);
+		serv_addr.sin_family = AF_INET;
+		serv_addr.sin_addr.s_addr = htonl (INADDR_ANY);
+		serv_addr.sin_port = htons (port);
+
+		/* Processes sharing a registry share the port too */
+		if (shm_opt)
+		{
+			opt = 1;
+			setsockopt (listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof (opt));
+		}
+
+		/* Bind */
+		if (bind (listen_fd, (struct sockaddr *)&serv_addr, sizeof (serv_addr)) < 0)
+		{
+			perror ("\x1B[34mSocket binding failed\x1B[37m");
+			return 1;
+		}
+
+		/* Listen */
+		if (listen (listen_fd, 10) < 0)
+		{
+			perror ("\x1B[34mSocket listening failed\x1B[37m");
+			return 1;
+		}
+	}
+
+	if ((fed_port || peer_count) && fed_init (fed_port ? &fed_addr : NULL, peers, peer_count) < 0)
 	{
-		perror ("\x1B[34mSocket binding failed\x1B[37m");
+		perror ("\x1B[34mFederation socket binding failed\x1B[37m");
 		return 1;
 	}
 
-	/* Listen */
-	if (listen (listenfd, 10) < 0)
+	/* Resume clients handed over by the previous process */
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		if (clients[i] && clients[i]->resumed)
+			pthread_create (&clients[i]->tid, NULL, &handle_client, (void *)clients[i]);
+	}
+
+	if (handoff_opt && handoff_init (handoff_opt) < 0)
 	{
-		perror ("\x1B[34mSocket listening failed\x1B[37m");
+		perror ("\x1B[34mUpgrade socket binding failed\x1B[37m");
 		return 1;
 	}
 
 	/* Accept clients */
 	while (1)
 	{
+		handoff_park ();
 		socklen_t clilen = sizeof (cli_addr);
-		connfd = accept (listenfd, (struct sockaddr *)&cli_addr, &clilen);
+		connfd = accept (listen_fd, (struct sockaddr *)&cli_addr, &clilen);
+
+		if (connfd < 0)
+			continue;
 
-		/* Check if max clients is reached */
-		if ((cli_count + 1) == MAX_CLIENTS)
+		/* Refuse addresses with too many connections or connecting too fast */
+		if (!admit_take (cli_addr.sin_addr.s_addr, 1))
 		{
+			event_log (EVENT_REJECT, cli_addr.sin_addr.s_addr, -1, NULL, NULL, "admission");
+			close (connfd);
+			continue;
+		}
+
+		/* Let the kernel drop a peer that stops acknowledging data */
+		if (stall_timeout)
+		{
+			unsigned int user_timeout = stall_timeout * TIMER_TICK;
+			setsockopt (connfd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof (user_timeout));
+		}
+
+		/* Check if max clients is reached, the free slot is the client UID */
+		if ((uid = queue_free_slot ()) < 0)
+		{
+			event_log (EVENT_REJECT, cli_addr.sin_addr.s_addr, -1, NULL, NULL, "full");
+			admit_release (cli_addr.sin_addr.s_addr);
 			close (connfd);
 			continue;
 		}
@@ -797,26 +6738,21 @@ int main (int argc, char *argv[])
 		client_t *cli = (client_t *)malloc (sizeof (client_t));
 		cli->addr = cli_addr;
 		cli->connfd = connfd;
-		/* Find next available client UID */
-		int i;
+		cli->uid = uid;
+		cli->echo = 1;
+		cli->math = NULL;
+		cli->resumed = 0;
 
-		for (i = 0; i < MAX_CLIENTS; i++)
-		{
-			if (!clients[i])
-			{
-				cli->uid = i;
-				break;
-			}
-		}
+		/* Without a token the session cannot be resumed */
+		if (getrandom (&cli->token, sizeof (cli->token), 0) != sizeof (cli->token))
+			cli->token = 0;
 
-		cli->echo = 1;
-		sprintf (cli->name, "%d", cli->uid);
+		client_output_init (cli);
+		/* Default names stay unique across processes sharing a registry */
+		sprintf (cli->name, "%d", cli->uid + (shm_self ? (int)(shm_self - shm_seg->procs) * MAX_CLIENTS : 0));
 		sprintf (cli->room, "Common");
 		sprintf (cli->status, "AVAILABLE");
 		/* Add client to the queue and fork thread */
-		queue_add (cli);
-		pthread_create (&tid, NULL, &handle_client, (void *)cli);
-		/* Reduce CPU usage */
-		sleep (1);
+		queue_add (cli, &handle_client);
 	}
 }
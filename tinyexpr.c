@@ -91,8 +91,10 @@ static te_expr *new_expr (const int type, const te_expr *parameters[])
 	const int arity = ARITY (type);
 	const int psize = sizeof (void *) * arity;
 	const int size = (sizeof (te_expr) - sizeof (void *)) + psize + (IS_CLOSURE (type) ? sizeof (void *) : 0);
-	te_expr *ret = malloc (size);
-	memset (ret, 0, size);
+	/* Never hand out less than a full te_expr, the node is accessed through that type */
+	const int alloc = size < (int)sizeof (te_expr) ? (int)sizeof (te_expr) : size;
+	te_expr *ret = malloc (alloc);
+	memset (ret, 0, alloc);
 
 	if (arity && parameters)
 	{